@@ -42,11 +42,11 @@ void channel_close() {
 	if (type==1) uart_close();		
 }
 
-uint8_t channel_recv(mavlink_message_t *msg) {
+uint16_t channel_recv(mavlink_parse_cb_t cb) {
 	if (type==0)
-		return udp_recv(msg);
+		return udp_recv(cb);
 	if (type==1)
-		return uart_recv(msg);	
+		return uart_recv(cb);	
 
 	return 0;
 }
@@ -55,3 +55,10 @@ void channel_send(mavlink_message_t *mavlink_msg) {
 	if (type==0) udp_send(mavlink_msg);
 	if (type==1) uart_send(mavlink_msg);		
 }
+
+int channel_get_fd() { //descriptor to wait on for incoming data
+	if (type==0) return udp_get_fd();
+	if (type==1) return uart_get_fd();
+
+	return -1;
+}
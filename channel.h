@@ -8,10 +8,12 @@ void channel_init();
 
 void channel_close();
 
-uint8_t channel_recv(mavlink_message_t *msg);
+uint16_t channel_recv(mavlink_parse_cb_t cb);
 
 void channel_send(mavlink_message_t *mavlink_msg);
 
+int channel_get_fd();
+
 void channel_set_gcip(char *arg);
 
 void channel_set_uartpath(char *arg);
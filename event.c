@@ -0,0 +1,229 @@
+#include "event.h"
+#include "sched.h"
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define TIMER_SLOT EVENT_MAX_FD //epoll data used for the timerfd
+
+static int epfd = -1;
+static int tfd = -1;
+
+static uint64_t armed = 0; //us, absolute deadline the timer is armed for
+
+static t_event_cb fd_cb[EVENT_MAX_FD];
+static uint8_t fd_count = 0;
+
+static t_event_cb flush_cb = NULL; //runs once per loop iteration, after all work is done
+
+static uint32_t fd_wakeups = 0;
+static uint32_t timer_wakeups = 0;
+static S_LATENCY tick_latency; //wakeup - deadline
+
+uint64_t event_now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+void latency_reset(S_LATENCY *l) {
+	memset(l,0,sizeof(S_LATENCY));
+	l->min = UINT32_MAX;
+}
+
+void latency_add(S_LATENCY *l, uint32_t us) {
+	l->count++;
+	if (us<l->min) l->min = us;
+	if (us>l->max) l->max = us;
+	l->sum += us;
+	l->sum2 += (uint64_t)us*us;
+}
+
+void latency_print(const char *name, S_LATENCY *l) {
+	double avg, var;
+
+	if (!l->count) {
+		printf("%s: no samples\n",name);
+		return;
+	}
+
+	avg = (double)l->sum/l->count;
+	var = (double)l->sum2/l->count - avg*avg;
+	if (var<0) var = 0;
+
+	printf("%s: n=%u min=%uus avg=%.0fus max=%uus jitter=%.0fus\n",name,l->count,l->min,avg,l->max,sqrt(var));
+}
+
+void histogram_reset(S_HISTOGRAM *h) {
+	memset(h,0,sizeof(S_HISTOGRAM));
+}
+
+void histogram_add(S_HISTOGRAM *h, uint32_t us) {
+	uint32_t i = us/HIST_BUCKET_US;
+
+	if (i>=HIST_BUCKETS) i = HIST_BUCKETS-1;
+	h->bucket[i]++;
+	h->count++;
+	if (us>h->max) h->max = us;
+}
+
+uint32_t histogram_percentile(S_HISTOGRAM *h, uint16_t permille) {
+	uint64_t rank = ((uint64_t)h->count*permille+999)/1000; //samples at or below the percentile
+	uint64_t sum = 0;
+	uint32_t us;
+	uint16_t i;
+
+	if (!h->count) return 0;
+	if (!rank) rank = 1;
+
+	for (i=0;i<HIST_BUCKETS;i++) {
+		sum += h->bucket[i];
+		if (sum>=rank) break;
+	}
+
+	us = (i+1)*HIST_BUCKET_US;
+	return (us>h->max)?h->max:us;
+}
+
+void histogram_print(const char *name, S_HISTOGRAM *h) {
+	if (!h->count) {
+		printf("%s: no samples\n",name);
+		return;
+	}
+
+	printf("%s: n=%u p50=%uus p90=%uus p99=%uus p99.9=%uus max=%uus\n",name,h->count,
+		histogram_percentile(h,500),histogram_percentile(h,900),histogram_percentile(h,990),histogram_percentile(h,999),h->max);
+}
+
+uint8_t event_init() {
+	struct epoll_event ev;
+
+	fd_count = 0;
+	armed = 0;
+	latency_reset(&tick_latency);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd<0) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd<0) {
+		perror("timerfd_create");
+		close(epfd);
+		return 1;
+	}
+
+	memset(&ev,0,sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = TIMER_SLOT;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev)<0) {
+		perror("epoll_ctl timerfd");
+		event_end();
+		return 1;
+	}
+
+	return 0;
+}
+
+void event_end() {
+	if (tfd>=0) close(tfd);
+	if (epfd>=0) close(epfd);
+	tfd = -1;
+	epfd = -1;
+}
+
+uint8_t event_add_fd(int fd, t_event_cb cb) {
+	struct epoll_event ev;
+
+	if (fd<0 || fd_count>=EVENT_MAX_FD) return 1;
+
+	memset(&ev,0,sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = fd_count;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)<0) {
+		perror("epoll_ctl");
+		return 1;
+	}
+
+	fd_cb[fd_count++] = cb;
+	return 0;
+}
+
+void event_set_flush(t_event_cb cb) {
+	flush_cb = cb;
+}
+
+//arms the timer for an absolute deadline (one-shot)
+static void timer_arm(uint64_t deadline) {
+	struct itimerspec its;
+
+	if (deadline==armed) return;
+
+	memset(&its,0,sizeof(its));
+	if (deadline!=UINT64_MAX) {
+		its.it_value.tv_sec = deadline/1000000;
+		its.it_value.tv_nsec = (deadline%1000000)*1000;
+	}
+
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL)<0) perror("timerfd_settime");
+	armed = deadline;
+}
+
+static void timer_expired() {
+	uint64_t expirations;
+	uint64_t now;
+
+	if (read(tfd, &expirations, sizeof(expirations))!=sizeof(expirations)) return;
+
+	now = event_now_us();
+	timer_wakeups++;
+	if (now>=armed) latency_add(&tick_latency, now-armed);
+	armed = 0;
+
+	sched_run(now);
+}
+
+//sleeps until an fd becomes readable or the next task deadline elapses
+void event_loop(uint8_t *stop) {
+	struct epoll_event ev[EVENT_MAX_FD+1];
+	int i,n;
+	uint8_t timer;
+
+	while (!(*stop)) {
+		timer_arm(sched_next());
+
+		n = epoll_wait(epfd, ev, EVENT_MAX_FD+1, -1);
+		if (n<0) {
+			if (errno==EINTR) continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		//service descriptors first so the tasks work with the freshest input
+		timer = 0;
+		for (i=0;i<n;i++) {
+			if (ev[i].data.u32==TIMER_SLOT) timer = 1;
+			else {
+				fd_wakeups++;
+				fd_cb[ev[i].data.u32]();
+			}
+		}
+
+		if (timer) timer_expired();
+
+		if (flush_cb) flush_cb();
+	}
+}
+
+void event_print_stats() {
+	printf("Loop: timer_wakeups=%u fd_wakeups=%u\n",timer_wakeups,fd_wakeups);
+	latency_print("Task wakeup latency",&tick_latency);
+	sched_print_stats();
+}
@@ -0,0 +1,56 @@
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+#include <stdint.h>
+
+/*
+	epoll based reactor
+	file descriptors are serviced as soon as they become readable
+	periodic work (see sched.h) is driven from absolute timerfd deadlines (CLOCK_MONOTONIC) so periods do not drift
+*/
+
+#define EVENT_MAX_FD 8
+
+typedef void (*t_event_cb)();
+
+struct _S_LATENCY {
+	uint32_t count;
+	uint32_t min; //us
+	uint32_t max; //us
+	uint64_t sum;
+	uint64_t sum2; //used for jitter (standard deviation)
+};
+typedef struct _S_LATENCY S_LATENCY;
+
+#define HIST_BUCKETS 400
+#define HIST_BUCKET_US 100 //40ms range, anything slower lands in the last bucket
+
+struct _S_HISTOGRAM {
+	uint32_t bucket[HIST_BUCKETS];
+	uint32_t count;
+	uint32_t max; //us
+};
+typedef struct _S_HISTOGRAM S_HISTOGRAM;
+
+uint8_t event_init();
+void event_end();
+
+uint8_t event_add_fd(int fd, t_event_cb cb);
+void event_set_flush(t_event_cb cb);
+
+void event_loop(uint8_t *stop);
+
+uint64_t event_now_us(); //monotonic time
+
+void latency_reset(S_LATENCY *l);
+void latency_add(S_LATENCY *l, uint32_t us);
+void latency_print(const char *name, S_LATENCY *l);
+
+void histogram_reset(S_HISTOGRAM *h);
+void histogram_add(S_HISTOGRAM *h, uint32_t us);
+uint32_t histogram_percentile(S_HISTOGRAM *h, uint16_t permille); //us, upper edge of the bucket
+void histogram_print(const char *name, S_HISTOGRAM *h);
+
+void event_print_stats();
+
+#endif
@@ -1,7 +1,11 @@
 #include "gamepad.h"
 #include "mw.h"
+#include "rx.h"
+#include "udp.h"
+#include "event.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define TRIMDELTA 5
 
@@ -17,13 +21,93 @@ static int8_t trim[2]; //0: trim_roll; 1: _pitch,
 static uint8_t mode; 
 static int16_t throttle = 1000;
 
+/*
+	input shaping: gamepads often send 10-20Hz while the board is fed every LOOP_MS
+	the sticks (not the throttle) are shaped from the arrival times of the last two samples of the source
+	that handed them to mw last, every source keeps its own samples
+	SHAPE 0: off, the newest sample is held
+	SHAPE 1: interpolation, smooth but one sample interval behind
+	SHAPE 2: extrapolation along the last two samples, at most SHAPE_HORIZON_MS ahead
+*/
+#define SHAPE_OFF 0
+#define SHAPE_INTERPOLATE 1
+#define SHAPE_EXTRAPOLATE 2
+#define SHAPE_HORIZON_MS 100
+#define SHAPE_MAX_GAP_MS 250 //samples further apart than this are held, the input has paused
+
+static uint8_t shape = SHAPE_OFF;
+
+#define EXPO_MAX 100 //%
+static uint8_t expo[3]; //%, yaw, pitch, roll; 0 - linear
+static int16_t expo_lut[3][1001]; //|stick| 0-1000 -> curve
+
+/*
+	MANUAL_CONTROL frames that arrive in one burst are coalesced per source: buttons and the relative
+	throttle see every frame, only the newest stick position is handed to mw once the batch is done
+*/
+#define MAX_GAMEPAD 4 //sources (sysid, compid) tracked, seq is counted per source
+#define GAMEPAD_SESSION_US 1000000 //a source silent for this long may restart its sequence numbers
+
+struct _S_GAMEPAD_SRC {
+	uint8_t sysid;
+	uint8_t compid;
+	uint8_t seq; //newest frame handled
+	uint64_t seen; //us, 0 - slot unused
+	uint16_t btn; //buttons of the previous frame
+	uint8_t pending; //input not handed to mw yet
+	int16_t t,y,p,r;
+	uint64_t rx_time; //us, see udp_get_rx_stamp
+	int16_t sample[2][3]; //previous and newest yaw, pitch, roll (pwm) handed to mw
+	uint64_t sample_time[2]; //us, arrival
+};
+typedef struct _S_GAMEPAD_SRC S_GAMEPAD_SRC;
+
+static S_GAMEPAD_SRC src[MAX_GAMEPAD];
+static S_GAMEPAD_SRC *sticks = NULL; //source the sticks of mw come from, see gamepad_shape
+
+static uint32_t frames = 0;
+static uint32_t coalesced = 0; //superseded by a newer frame of the same batch
+static uint32_t stale = 0; //sequence number not newer than one already handled
+
+void msg_manual_control(mavlink_message_t *msg);
+void gamepad_batch_end();
+
+static void expo_build(uint8_t axis) {
+	uint16_t i;
+	float x, e = expo[axis]/100.f;
+
+	for (i=0;i<=1000;i++) {
+		x = i/1000.f;
+		expo_lut[axis][i] = (x*(1.f-e) + x*x*x*e)*1000.f + 0.5f;
+	}
+}
+
+static int16_t expo_apply(uint8_t axis, int16_t v) {
+	int32_t a = abs((int32_t)v); //INT16_MIN has no int16_t absolute value
+
+	if (a>1000) a = 1000;
+	return v<0?-expo_lut[axis][a]:expo_lut[axis][a];
+}
+
 void gamepad_init() {
 	uint8_t i;
 	for (i=0;i<BUTTONS_COUNT;i++)
 		mapping[i] = UINT8_MAX;
 
+	for (i=0;i<3;i++) {
+		expo[i] = 0;
+		expo_build(i);
+	}
+	mw_set_rc_shaper(gamepad_shape);
+
 	trim[0] = 0;
 	trim[1] = 0;
+
+	memset(src,0,sizeof(src));
+	sticks = NULL;
+
+	rx_register(MAVLINK_MSG_ID_MANUAL_CONTROL, msg_manual_control);
+	rx_register_batch_end(gamepad_batch_end);
 }
 
 uint8_t gamepad_button_count() {
@@ -128,6 +212,56 @@ int32_t constrain(int32_t v, int32_t min, int32_t max) {
 	return v;
 }
 
+void gamepad_set_expo(uint8_t *value, uint8_t i) {
+	expo[i] = (*value)>EXPO_MAX?EXPO_MAX:(*value);
+	expo_build(i);
+}
+
+void gamepad_get_expo(uint8_t *value, uint8_t i) {
+	(*value) = expo[i];
+}
+
+void gamepad_set_shape(uint8_t *value) {
+	shape = (*value)>SHAPE_EXTRAPOLATE?SHAPE_OFF:(*value);
+}
+
+void gamepad_get_shape(uint8_t *value) {
+	(*value) = shape;
+}
+
+//called by mw whenever rc goes to the board
+void gamepad_shape(uint64_t now, struct S_MSP_RC *rc) {
+	uint64_t interval, since;
+	int32_t v[3];
+	uint8_t i;
+	int16_t (*sample)[3];
+	uint64_t *sample_time;
+
+	if (shape==SHAPE_OFF || !sticks || !sticks->sample_time[1]) return;
+
+	sample = sticks->sample;
+	sample_time = sticks->sample_time;
+
+	interval = sample_time[1]-sample_time[0];
+	since = now>sample_time[1]?now-sample_time[1]:0;
+
+	for (i=0;i<3;i++) {
+		if (!sample_time[0] || !interval || interval>SHAPE_MAX_GAP_MS*1000 || since>SHAPE_MAX_GAP_MS*1000) {
+			v[i] = sample[1][i]; //not enough recent samples, hold the newest one
+		} else if (shape==SHAPE_INTERPOLATE) {
+			v[i] = sample[0][i] + (sample[1][i]-sample[0][i])*(int64_t)(since>interval?interval:since)/(int64_t)interval;
+		} else { //no further than one sample interval and the horizon ahead
+			if (since>interval) since = interval;
+			if (since>SHAPE_HORIZON_MS*1000) since = SHAPE_HORIZON_MS*1000;
+			v[i] = sample[1][i] + (sample[1][i]-sample[0][i])*(int64_t)since/(int64_t)interval;
+		}
+	}
+
+	rc->yaw = constrain(v[0],1000,2000);
+	rc->pitch = constrain(v[1],1000,2000);
+	rc->roll = constrain(v[2],1000,2000);
+}
+
 void gamepad_update_trim(uint8_t _trim, int8_t delta) { //0 -roll, 1- pitch
 	int16_t tmp;
 	tmp = trim[_trim] + delta;
@@ -167,6 +301,10 @@ void gamepad_control_calculate(int16_t *_throttle, int16_t *_yaw, int16_t *_pitc
 
 	throttle = constrain(throttle,1000,2000);
 
+	y = expo_apply(0,y);
+	p = expo_apply(1,p);
+	r = expo_apply(2,r);
+
 	//translate between -1000 1000 and mw pwm (1000,2000)
 	y = (y/2)+1500;
 	r = (r/2)+1500;
@@ -193,3 +331,93 @@ void gamepad_control_calculate(int16_t *_throttle, int16_t *_yaw, int16_t *_pitc
 	//TODO: constrain
 }
 
+//slot of the source, the least recently seen one is taken over when all are in use
+static S_GAMEPAD_SRC *gamepad_source(uint8_t sysid, uint8_t compid) {
+	uint8_t i;
+	S_GAMEPAD_SRC *s = &src[0];
+
+	for (i=0;i<MAX_GAMEPAD;i++) {
+		if (src[i].seen && src[i].sysid==sysid && src[i].compid==compid) return &src[i];
+		if (src[i].seen<s->seen) s = &src[i];
+	}
+
+	memset(s,0,sizeof(S_GAMEPAD_SRC));
+	s->sysid = sysid;
+	s->compid = compid;
+	return s;
+}
+
+void msg_manual_control(mavlink_message_t *msg) {
+	S_GAMEPAD_SRC *s = gamepad_source(msg->sysid,msg->compid);
+	uint64_t now = event_now_us();
+
+	uint16_t btn;
+	uint16_t i;
+	uint8_t btn_mapping;
+
+	int16_t t,y,p,r;
+
+	frames++;
+
+	//frames carry no timestamp, the sequence number (mod 256) tells which one is newer
+	if (s->seen && now-s->seen<GAMEPAD_SESSION_US && (int8_t)(msg->seq-s->seq)<=0) {
+		stale++;
+		return;
+	}
+	s->seq = msg->seq;
+	s->seen = now;
+
+	t = mavlink_msg_manual_control_get_z(msg);
+	y = mavlink_msg_manual_control_get_r(msg);
+	p = mavlink_msg_manual_control_get_x(msg);
+	r = mavlink_msg_manual_control_get_y(msg);
+
+	btn=mavlink_msg_manual_control_get_buttons(msg);
+
+	if (btn!=s->btn) {
+
+		for (i=0;i<gamepad_button_count();i++) {
+			gamepad_get_mapping(&btn_mapping,i);
+			if (get_bit(s->btn,btn_mapping) && (get_bit(btn,btn_mapping)==0)) { gamepad_button_pressed(i); }
+		}
+
+		s->btn = btn;
+	}
+
+	gamepad_control_calculate(&t,&y,&p,&r); //every frame, the relative throttle adds up
+
+	if (s->pending) coalesced++;
+	s->pending = 1;
+	s->t = t;
+	s->y = y;
+	s->p = p;
+	s->r = r;
+	s->rx_time = udp_get_rx_stamp();
+}
+
+void gamepad_batch_end() {
+	uint8_t i;
+	S_GAMEPAD_SRC *s;
+
+	for (i=0;i<MAX_GAMEPAD;i++) {
+		s = &src[i];
+		if (!s->pending) continue;
+		s->pending = 0;
+
+		s->sample[0][0] = s->sample[1][0];
+		s->sample[0][1] = s->sample[1][1];
+		s->sample[0][2] = s->sample[1][2];
+		s->sample_time[0] = s->sample_time[1];
+		s->sample[1][0] = s->y;
+		s->sample[1][1] = s->p;
+		s->sample[1][2] = s->r;
+		s->sample_time[1] = s->rx_time;
+		sticks = s;
+
+		mw_manual_control(s->t,s->y,s->p,s->r,s->rx_time);
+	}
+}
+
+void gamepad_print_stats() {
+	printf("Gamepad: frames=%u coalesced=%u stale=%u\n",frames,coalesced,stale);
+}
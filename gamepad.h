@@ -17,6 +17,13 @@ void gamepad_get_mapping(uint8_t *action, uint8_t btn);
 void gamepad_set_threshold(uint8_t *value, uint8_t i);
 void gamepad_get_threshold(uint8_t *value, uint8_t i);
 
+void gamepad_set_expo(uint8_t *value, uint8_t i);
+void gamepad_get_expo(uint8_t *value, uint8_t i);
+
+void gamepad_set_shape(uint8_t *value);
+void gamepad_get_shape(uint8_t *value);
+void gamepad_shape(uint64_t now, struct S_MSP_RC *rc);
+
 void gamepad_control_calculate(int16_t *throttle, int16_t *yaw, int16_t *pitch, int16_t *roll);
 void gamepad_control_reset_throttle();
 
@@ -25,4 +32,6 @@ const char* gamepad_get_button_name(uint8_t i);
 void gamepad_button_pressed(uint8_t i);
 void gamepad_update_trim(uint8_t _trim, int8_t delta);
 
+void gamepad_print_stats();
+
 #endif
@@ -4,14 +4,23 @@
 #include "def.h"
 
 #define CFG_FILE "/usr/local/etc/mw/mw-mavlink.cfg"
+//the benchmarks build with their own files, see Makefile.am
+#ifndef PARAM_STORE_FILE
+#define PARAM_STORE_FILE "/usr/local/etc/mw/mw-mavlink.store" //saved params, see params.c
+#define PARAM_STORE_DIR "/usr/local/etc/mw" //of PARAM_STORE_FILE, synced after a rename
+#endif
+#ifndef MW_CACHE_FILE
+#define MW_CACHE_FILE "/usr/local/etc/mw/mw-mavlink.board" //board configuration, see mw.c
+#endif
 
 #define REBOOT_CMD "/sbin/reboot &"
 #define CAM_CMD "/usr/local/bin/camera_streamer.sh"
 
-void mssleep(unsigned int ms);
 
 extern uint16_t heartbeat;
 
+extern uint64_t start_time; //us, monotonic, when the process started
+
 #ifdef CFG_ENABLED
 #include <libconfig.h>
 extern config_t cfg;
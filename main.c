@@ -11,6 +11,11 @@
 #include "mw.h"
 #include "udp.h"
 #include "mavlink.h"
+#include "event.h"
+#include "sched.h"
+#include "rx.h"
+#include "gamepad.h"
+#include "params.h"
 #include "def.h"
 #include "global.h"
 
@@ -18,9 +23,13 @@
 uint8_t debug = 0;
 
 uint8_t stop = 0;
-uint16_t loop_counter = 0;
+
+uint64_t start_time = 0;
 
 void check_incoming_udp(); //checks for messages on UDP port
+void msg_heartbeat_gcs(mavlink_message_t *msg);
+void heartbeat_countdown();
+void print_stats();
 
 #define HEARTBEAT_LIFE 3000/LOOP_MS
 //heartbeat is used to trigger mavlink failsafe as defined in emergency in mavlink.c
@@ -32,106 +41,117 @@ uint16_t heartbeat = 0;
 typedef void (*t_cb)();
 
 struct _S_TASK {
-	uint16_t freq; //has to be less than loop_counter max value
+	uint16_t period; //ms
+	uint16_t phase; //ms, offset of the first run
 	t_cb cb_fn;
 };
 typedef struct _S_TASK S_TASK;
 
-#define MAX_TASK 3
+#define MAX_TASK 2
 
 static S_TASK task[MAX_TASK] = {
-	{1, check_incoming_udp}, //run every LOOP_MS (see global.h)
-	{1, mw_loop},
-	{1, mavlink_loop}
+	{LOOP_MS, 0, heartbeat_countdown}, //see global.h
+	{10000, 0, print_stats}
 };
 
-static mavlink_message_t mav_msg;
-
 
-void check_incoming_udp() {
+void heartbeat_countdown() {
 	if (heartbeat) heartbeat--;
-
-	while (udp_recv(&mav_msg)) {
-		if (debug) printf("<- MsgID: %u\n",mav_msg.msgid);
-		switch (mav_msg.msgid) {
-			case MAVLINK_MSG_ID_HEARTBEAT:
-				heartbeat = HEARTBEAT_LIFE;
-			 	break;
-
-			case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
-				msg_param_request_list(&mav_msg);
-				break;
-			case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
-				msg_param_request_read(&mav_msg);
-				break;
-			case MAVLINK_MSG_ID_PARAM_SET:
-				msg_param_set(&mav_msg);
-				break;				
-			case MAVLINK_MSG_ID_MISSION_REQUEST_LIST:
-				msg_mission_request_list(&mav_msg);
-				break;
-			case MAVLINK_MSG_ID_COMMAND_LONG:
-				msg_command_long(&mav_msg);
-				break;	
-			case MAVLINK_MSG_ID_MANUAL_CONTROL:
-				msg_manual_control(&mav_msg);
-				break;			
-			default: printf("Unknown message id: %u\n",mav_msg.msgid);
-		}
-		//process message
-	}
 }
 
+void print_stats() {
+	if (!debug) return;
+	event_print_stats();
+	udp_print_stats();
+	rx_print_stats();
+	mw_print_stats();
+	gamepad_print_stats();
+	params_print_stats();
+}
 
+void msg_heartbeat_gcs(mavlink_message_t *msg) {
+	heartbeat = HEARTBEAT_LIFE;
+}
 
-void mssleep(unsigned int ms) {
-  struct timespec tim;
-   tim.tv_sec = ms/1000;
-   tim.tv_nsec = 1000000L * (ms % 1000);
-   if(nanosleep(&tim , &tim) < 0 )
-   {
-      printf("Nano sleep system call failed \n");
-   }
+//called by the reactor as soon as the UDP socket becomes readable
+void check_incoming_udp() {
+	udp_recv(rx_dispatch); //handlers are registered by the modules, see rx.h
+	rx_batch_end();
 }
 
 
-//runs all tasks as per defined frequency
-void loop() {
+//registers our tasks and runs the reactor until stopped
+uint8_t loop() {
 	uint8_t i;
-	loop_counter=0;
-	while (!stop) {
 
-		for (i=0;i<MAX_TASK;i++)
-			if (loop_counter%task[i].freq==0) {
-				task[i].cb_fn();
-			}
+	if (event_init()) return 1;
+
+	for (i=0;i<MAX_TASK;i++)
+		sched_add(task[i].cb_fn,task[i].period,task[i].phase);
 
-		mssleep(LOOP_MS);
-		loop_counter++;
-		if (loop_counter==1000) loop_counter=0;
+	if (event_add_fd(udp_get_fd(), check_incoming_udp)) {
+		event_end();
+		return 1;
 	}
+
+	event_set_flush(udp_flush); //everything queued during this tick goes out together
+
+	event_loop(&stop);
+
+	event_end();
+	return 0;
 }
 
 char target_ip[64];
 int target_port=14550, local_port;
 
+#define MAX_EXTRA_TARGET UDP_MAX_TARGET
+char extra_ip[MAX_EXTRA_TARGET][64];
+int extra_port[MAX_EXTRA_TARGET];
+uint8_t extra_count = 0;
+
+uint16_t handshake_deadline = 5000; //ms
+uint32_t link_budget = 0; //bytes/s
+uint16_t rc_spacing = 0; //ms
+uint16_t param_rate = 0; //params/s
+uint8_t write_commit = 0;
+
 void print_usage() {
     printf("Usage:\n");
 	printf("-h\thelp\n");
     printf("-t TARGET\tip address of QGroundControl\n");
     printf("-p PORT\tQGroundControl port to use (default: %i)\n",target_port);
     printf("-l PORT\tlocal port to use\n");
+    printf("-a IP:PORT\tadditional GCS to send telemetry to (up to %i)\n",MAX_EXTRA_TARGET);
+    printf("-w MS\tdeadline for loading the board configuration (default: %u)\n",handshake_deadline);
+    printf("-b BYTES\tlink budget in bytes/s, e.g. 5760 for a 57600 baud radio (default: unlimited)\n");
+    printf("-r MS\tforward stick input to the board as soon as it arrives, at most every MS ms (default: off, fed every %ums)\n",LOOP_MS);
+    printf("-P RATE\tparams/s sent during a param list transfer (default: 200)\n");
+    printf("-e\tcommit param changes to the board eeprom after every batch of writes\n");
     printf("-d for debug\n");
 }
 
 int set_defaults(int c, char **a) {
 	int required = 2;
     int option;
-    while ((option = getopt(c, a,"ht:p:l:d")) != -1) {
+    char *ptr;
+    while ((option = getopt(c, a,"ht:p:l:a:w:b:r:P:ed")) != -1) {
         switch (option)  {
             case 't': strcpy(target_ip,optarg); required--; break;
             case 'p': target_port = atoi(optarg); break;
             case 'l': local_port = atoi(optarg); required--; break;
+            case 'a':
+            	ptr = strchr(optarg,':');
+            	if (!ptr || extra_count>=MAX_EXTRA_TARGET) { print_usage(); return -1; }
+            	*ptr = 0;
+            	strncpy(extra_ip[extra_count],optarg,63);
+            	extra_port[extra_count++] = atoi(ptr+1);
+            	break;
+            case 'w': handshake_deadline = atoi(optarg); break;
+            case 'b': link_budget = atoi(optarg); break;
+            case 'r': rc_spacing = atoi(optarg); break;
+            case 'P': param_rate = atoi(optarg); break;
+            case 'e': write_commit = 1; break;
             case 'd': debug = 1; break;
             default: print_usage(); return -1;
         }
@@ -152,19 +172,34 @@ void catch_signal(int sig)
 
 int main(int argc, char* argv[])
 {
+	uint8_t i;
+
 	signal(SIGTERM, catch_signal);
     signal(SIGINT, catch_signal);
 
     dbg_init(0); //0b11111111 init the mw library debug
 
+    start_time = event_now_us();
+
+    sched_init();
+    rx_init();
+    rx_register(MAVLINK_MSG_ID_HEARTBEAT, msg_heartbeat_gcs);
+
     if (set_defaults(argc,argv)) {
     	return -1;
     }
 
     printf("Initializing UDP...\n");
  	udp_init(target_ip,target_port,local_port);
+ 	for (i=0;i<extra_count;i++)
+ 		udp_add_target(extra_ip[i],extra_port[i]);
+ 	udp_set_budget(link_budget);
+ 	if (link_budget) printf("Link budget: %u bytes/s\n",link_budget);
 
  	printf("Setting up mw...\n");
+ 	mw_set_handshake_deadline(handshake_deadline);
+ 	mw_set_rc_cut_through(rc_spacing);
+ 	mw_set_write_commit(write_commit);
  	if (mw_init()) {
  		printf("Error mw_init!\n");
  		return -1;
@@ -172,6 +207,7 @@ int main(int argc, char* argv[])
 
  	printf("Initializing PARAMS...\n");
  	params_init(); 	
+ 	params_set_list_rate(param_rate);
 
   	printf("Setting up mavlink...\n");
  	if (mavlink_init()) {
@@ -180,9 +216,12 @@ int main(int argc, char* argv[])
  	}	
 
  	printf("Started.\n");
- 	loop();
+ 	if (loop()) printf("Error setting up the event loop!\n");
  	
  	printf("Cleaning up...\n");
+ 	event_print_stats();
+ 	udp_print_stats();
+ 	rx_print_stats();
  	mavlink_end();
 
  	params_end();
@@ -5,17 +5,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "gamepad.h"
+#include "sched.h"
+#include "rx.h"
+#include "event.h"
 #include <sys/time.h>
 
 static uint8_t debug = 0;
-static uint16_t manual_control_counter = 0;
-static uint64_t current_time; //ms
-
-typedef uint8_t (*t_cb_i)(uint8_t);
-t_cb_i loop_callback; //we use loop_callback to send certain messages with a delay
 
 static mavlink_message_t mav_msg;
 
+#if MAVLINK_NEED_BYTE_SWAP
+#error "Telemetry is serialized from the wire-ordered mavlink_xxx_t structs, a little endian host is required"
+#endif
+
 
 void msg_sys_status();
 void msg_radio_status();
@@ -28,24 +30,54 @@ void msg_home_position();
 
 typedef void (*t_cb)();
 
+#define MAX_SRC 2
+
+#define MIN_PERIOD 10 //ms, fastest rate a GCS can ask for
+#define MAX_TX_SCALE 8 //slowest low priority telemetry gets on a saturated link
+
+//SiK style radios report the free space of their transmit buffer in RADIO_STATUS.txbuf (%)
+#define RADIO_SYSID 51 //'3', sysid the radio reports with
+#define RADIO_TXBUF_LOW 50 //%, below this the telemetry rate is halved
+#define RADIO_TXBUF_HIGH 90 //%, above this the telemetry rate ramps back up
+#define RADIO_RATE_MIN 10 //%, of the configured rates
+#define RADIO_RATE_STEP 5 //%, ramp up per report
+#define RADIO_TIMEOUT 5000000 //us, the configured rates are restored when the radio stops reporting
+#define NO_STREAM MAV_DATA_STREAM_ENUM_END //not controlled by REQUEST_DATA_STREAM
+
 struct _S_TASK {
-	uint16_t freq; //has to be less than loop_counter max value
+	uint16_t period; //ms, default; changed at runtime by SET_MESSAGE_INTERVAL / REQUEST_DATA_STREAM, 0 - disabled
+	uint16_t phase; //ms, spreads tasks of the same period across ticks
 	t_cb cb_fn;
+	uint8_t msgid;
+	uint8_t stream; //MAV_DATA_STREAM the message belongs to
+	uint8_t always; //sent even when no GCS is listening
+	uint8_t src[MAX_SRC]; //MSP data the message is built from, polled only as fast as the message is sent
+	uint16_t sched_id;
+	uint8_t demand[MAX_SRC]; //see mw_demand_add
+	uint16_t def_period; //ms
+	uint16_t interval; //ms, period actually used (period limited by the sources)
 };
 typedef struct _S_TASK S_TASK;
 
 #define MAX_TASK 7
 
 static S_TASK task[MAX_TASK] = {
-	{4, msg_attitude_quaternion}, //run every LOOP_MS (see global.h)
-	{40, msg_gps_raw_int},
-	{20, msg_global_position_int},
-	{40, msg_heartbeat},
-	{40, msg_sys_status},
-	{40, msg_radio_status},	
-	{80, msg_home_position}
+	{100, 0, msg_attitude_quaternion, MAVLINK_MSG_ID_ATTITUDE_QUATERNION, MAV_DATA_STREAM_EXTRA1, 0, {MSP_ATTITUDE}},
+	{1000, 0, msg_gps_raw_int, MAVLINK_MSG_ID_GPS_RAW_INT, MAV_DATA_STREAM_EXTENDED_STATUS, 0, {MSP_RAW_GPS}},
+	{500, 100, msg_global_position_int, MAVLINK_MSG_ID_GLOBAL_POSITION_INT, MAV_DATA_STREAM_POSITION, 0, {MSP_RAW_GPS, MSP_ALTITUDE}},
+	{1000, 200, msg_heartbeat, MAVLINK_MSG_ID_HEARTBEAT, NO_STREAM, 1, {MSP_BOX}},
+	{1000, 400, msg_sys_status, MAVLINK_MSG_ID_SYS_STATUS, MAV_DATA_STREAM_EXTENDED_STATUS, 0, {MSP_ANALOG}},
+	{1000, 600, msg_radio_status, MAVLINK_MSG_ID_RADIO_STATUS, MAV_DATA_STREAM_EXTRA3},
+	{2000, 800, msg_home_position, MAVLINK_MSG_ID_HOME_POSITION, NO_STREAM}
 };
 
+static uint8_t gcs_active = 0; //a GCS heartbeat has been seen recently or there are -a targets
+static uint8_t tx_scale = 1; //period multiplier for low priority telemetry, see mavlink_budget_check
+static uint8_t radio_rate = 100; //%, telemetry rate allowed by the radio, see msg_radio_status_in
+static uint64_t radio_seen = 0; //us, last RADIO_STATUS from the radio
+
+void mavlink_link_check();
+
 uint64_t microsSinceEpoch()
 {
 	struct timeval tv;
@@ -55,25 +87,126 @@ uint64_t microsSinceEpoch()
 	return micros;
 }
 
-void mavlink_loop() {
-	static uint8_t counter = 0;
+//applies the period of a telemetry message to the scheduler and to the MSP polling behind it
+static void telemetry_apply(uint8_t i) {
+	S_TASK *t = &task[i];
+	uint8_t active = gcs_active || t->always;
+	uint16_t period = t->period;
+	uint32_t scaled;
+	uint16_t min;
+	uint8_t j;
+
+	if (udp_get_prio(t->msgid)>TX_PRIO_HEARTBEAT) { //heartbeat and acks always keep their rate
+		scaled = (uint32_t)period*tx_scale*100/radio_rate;
+		period = (scaled>UINT16_MAX)?UINT16_MAX:scaled;
+	}
+
+	for (j=0;j<MAX_SRC;j++) {
+		if (!t->src[j]) continue;
+		min = mw_demand_set(t->demand[j], active?period:0);
+		if (period && period<min) period = min; //never faster than the source refreshes
+	}
+
+	t->interval = period;
+	sched_set_period(t->sched_id, active?period:0);
+}
+
+static S_TASK *telemetry_find(uint16_t msgid) {
+	uint8_t i;
+
+	for (i=0;i<MAX_TASK;i++)
+		if (task[i].msgid==msgid) return &task[i];
+
+	return NULL;
+}
+
+//telemetry is paused while nobody is listening, only the heartbeat keeps going
+//additional targets (-a) are passive listeners that send no heartbeat, with any of them telemetry never pauses
+void mavlink_link_check() {
+	uint8_t i;
+	uint8_t active = heartbeat>0 || udp_get_target_count();
+
+	if (active==gcs_active) return;
+	gcs_active = active;
+
+	printf("GCS %s%s, telemetry %s\n",heartbeat>0?"connected":"lost",udp_get_target_count()?" (-a targets listening)":"",active?"resumed":"paused");
+	for (i=0;i<MAX_TASK;i++)
+		telemetry_apply(i);
+}
+
+static void radio_set_rate(uint8_t rate) {
 	uint8_t i;
 
-	current_time = microsSinceEpoch();
+	if (rate==radio_rate) return;
+	radio_rate = rate;
 
+	if (debug) printf("Radio: telemetry at %u%%\n",radio_rate);
 	for (i=0;i<MAX_TASK;i++)
-		if (counter%task[i].freq==0) {
-			task[i].cb_fn();
-		}
+		telemetry_apply(i);
+}
+
+//AIMD over the telemetry rate: halved while the radio buffer fills up, ramped up slowly while it stays empty
+void msg_radio_status_in(mavlink_message_t *msg) {
+	uint8_t txbuf;
+	uint8_t rate = radio_rate;
+
+	if (msg->sysid!=RADIO_SYSID) return; //a GCS forwarding its own radio
 
-	//callbacks etc
-	if (loop_callback) if (loop_callback(0)) loop_callback = NULL;
+	txbuf = mavlink_msg_radio_status_get_txbuf(msg);
+	radio_seen = event_now_us();
 
-	counter++;
-	if (counter==100) counter=0;
+	if (txbuf<RADIO_TXBUF_LOW) rate = (rate/2<RADIO_RATE_MIN)?RADIO_RATE_MIN:rate/2;
+	else if (txbuf>RADIO_TXBUF_HIGH) rate = (rate+RADIO_RATE_STEP>100)?100:rate+RADIO_RATE_STEP;
+
+	radio_set_rate(rate);
+}
+
+//low priority telemetry backs off while the link budget runs dry and recovers once there is headroom again
+void mavlink_budget_check() {
+	uint8_t i;
+	uint8_t scale = tx_scale;
+
+	if (radio_rate<100 && event_now_us()-radio_seen>RADIO_TIMEOUT) radio_set_rate(100);
+
+	switch (udp_get_pressure()) {
+		case UDP_TX_DRY:
+			if (scale<MAX_TX_SCALE) scale*=2;
+			break;
+		case UDP_TX_IDLE:
+			if (scale>1) scale/=2;
+			break;
+	}
+
+	if (scale==tx_scale) return;
+	tx_scale = scale;
+
+	printf("Link budget: low priority telemetry at 1/%u rate\n",tx_scale);
+	for (i=0;i<MAX_TASK;i++)
+		telemetry_apply(i);
 }
 
 uint8_t mavlink_init() {
+	uint8_t i,j;
+
+	gcs_active = 0;
+	tx_scale = 1;
+	radio_rate = 100;
+	for (i=0;i<MAX_TASK;i++) {
+		task[i].def_period = task[i].period;
+		task[i].sched_id = sched_add(task[i].cb_fn,(task[i].always?task[i].period:0),task[i].phase);
+		for (j=0;j<MAX_SRC;j++)
+			if (task[i].src[j]) task[i].demand[j] = mw_demand_add(task[i].src[j]);
+		telemetry_apply(i);
+	}
+
+	sched_add(mavlink_link_check,LOOP_MS,0);
+	sched_add(mavlink_budget_check,1000,0);
+
+	rx_register(MAVLINK_MSG_ID_COMMAND_LONG, msg_command_long);
+	rx_register(MAVLINK_MSG_ID_REQUEST_DATA_STREAM, msg_request_data_stream);
+	rx_register(MAVLINK_MSG_ID_RADIO_STATUS, msg_radio_status_in);
+	rx_register(MAVLINK_MSG_ID_MISSION_REQUEST_LIST, msg_mission_request_list);
+
 	return 0;
 }
 
@@ -88,60 +221,116 @@ void mav_cmd_arm_disarm(mavlink_message_t *msg) {
 	else mw_disarm();
 }
 
-void msg_command_long(mavlink_message_t *msg) {
-	uint16_t cmd;
-	cmd = mavlink_msg_command_long_get_command(msg);
+void msg_command_ack(uint16_t cmd, uint8_t result) {
+	mavlink_command_ack_t packet;
 
-	switch (cmd) {
-		case MAV_CMD_COMPONENT_ARM_DISARM:
-			mav_cmd_arm_disarm(msg);
-			break;
-		default: printf("Unknown mav_cmd: %u\n",cmd);
-	}
-	printf("mav_cmd: %u\n",cmd);
+	packet.command = cmd;
+	packet.result = result;
+
+	DISPATCH(COMMAND_ACK, packet);
 }
 
-void msg_param_set(mavlink_message_t *msg) {
-	//it takes 2 set messages to set it
-	//on the first set we send a set message to mw and request a refresh
-	//on the second set - we just check if the value was refreshed to the value that is being set
-	//firstly check if the value we have is different
+void msg_message_interval(uint16_t msgid) {
+	mavlink_message_interval_t packet;
+	S_TASK *t = telemetry_find(msgid);
+
+	packet.message_id = msgid;
+	if (!t) packet.interval_us = 0; //not available
+	else if (!t->interval) packet.interval_us = -1; //disabled
+	else packet.interval_us = (int32_t)t->interval*1000;
+
+	DISPATCH(MESSAGE_INTERVAL, packet);
+}
+
+//param1 of SET/GET_MESSAGE_INTERVAL, the message id as a float; -1 if it is none (out of range or NaN)
+static int16_t message_interval_id(mavlink_message_t *msg) {
+	float id = mavlink_msg_command_long_get_param1(msg);
+
+	if (!(id>=0 && id<=255)) return -1; //converting it would be undefined
+	return id;
+}
+
+uint8_t mav_cmd_set_message_interval(mavlink_message_t *msg) {
+	int16_t msgid = message_interval_id(msg);
+	float interval = mavlink_msg_command_long_get_param2(msg); //us
+	S_TASK *t;
+
+	if (msgid<0) return MAV_RESULT_DENIED;
+	t = telemetry_find(msgid);
+	if (!t) return MAV_RESULT_UNSUPPORTED;
 
-	uint8_t component;
-	char name[16+1];
-	float value;
+	if (interval<0) t->period = 0; //disable
+	else if (interval==0) t->period = t->def_period;
+	else if (interval/1000>UINT16_MAX) t->period = UINT16_MAX;
+	else if (interval/1000<MIN_PERIOD) t->period = MIN_PERIOD;
+	else t->period = interval/1000;
 
-	component = mavlink_msg_param_set_get_target_component(msg);
-	mavlink_msg_param_set_get_param_id(msg,name); //get name from the param
-	value = mavlink_msg_param_set_get_param_value(msg);
+	telemetry_apply(t-task);
+	if (debug) printf("Message %u interval: %u ms\n",msgid,t->interval);
 
-	printf("Set id: %s\n",name);
+	msg_message_interval(msgid);
+	return MAV_RESULT_ACCEPTED;
+}
+
+uint8_t mav_cmd_get_message_interval(mavlink_message_t *msg) {
+	int16_t msgid = message_interval_id(msg);
 
-	params_set(component,name,value);
+	if (msgid<0) return MAV_RESULT_DENIED;
+	msg_message_interval(msgid);
+	return MAV_RESULT_ACCEPTED;
 }
 
-void msg_param_request_read(mavlink_message_t *msg) {
-	int16_t idx;
-	uint8_t component;
-	component = mavlink_msg_param_request_read_get_target_component(msg);
-	idx = mavlink_msg_param_request_read_get_param_index(msg);
+//legacy stream control, every message of the stream gets the requested rate
+void msg_request_data_stream(mavlink_message_t *msg) {
+	uint8_t stream = mavlink_msg_request_data_stream_get_req_stream_id(msg);
+	uint16_t rate = mavlink_msg_request_data_stream_get_req_message_rate(msg); //Hz
+	uint8_t start = mavlink_msg_request_data_stream_get_start_stop(msg);
+	uint8_t i;
+	S_TASK *t;
+
+	for (i=0;i<MAX_TASK;i++) {
+		t = &task[i];
+		if (t->stream==NO_STREAM) continue;
+		if (stream!=MAV_DATA_STREAM_ALL && stream!=t->stream) continue;
 
-	printf("Requesting param id: %i, component: %u\n",idx,component);
-	params_send(component,idx); //TODO: the idx has to be global, but idx is local?
+		if (!start) t->period = 0;
+		else if (!rate) t->period = t->def_period;
+		else t->period = (1000/rate<MIN_PERIOD)?MIN_PERIOD:1000/rate;
+
+		telemetry_apply(i);
+	}
+
+	if (debug) printf("Data stream %u: %s at %u Hz\n",stream,start?"start":"stop",rate);
 }
 
-void msg_param_request_list(mavlink_message_t *msg) {
-	loop_callback = params_get_all;
-	params_get_all(1);
+void msg_command_long(mavlink_message_t *msg) {
+	uint16_t cmd;
+	cmd = mavlink_msg_command_long_get_command(msg);
+
+	switch (cmd) {
+		case MAV_CMD_COMPONENT_ARM_DISARM:
+			mav_cmd_arm_disarm(msg);
+			break;
+		case MAV_CMD_SET_MESSAGE_INTERVAL:
+			msg_command_ack(cmd, mav_cmd_set_message_interval(msg));
+			break;
+		case MAV_CMD_GET_MESSAGE_INTERVAL:
+			msg_command_ack(cmd, mav_cmd_get_message_interval(msg));
+			break;
+		default: printf("Unknown mav_cmd: %u\n",cmd);
+	}
+	printf("mav_cmd: %u\n",cmd);
 }
 
-uint8_t msg_mission_request_list(mavlink_message_t *msg) {
+void msg_mission_request_list(mavlink_message_t *msg) {
 	if (debug) printf("-> mission_count\n");
-	mavlink_msg_mission_count_pack(1,200,&mav_msg,1,200,0);
+	mavlink_mission_count_t packet;
 
-	dispatch(&mav_msg);
+	packet.count = 0;
+	packet.target_system = 1;
+	packet.target_component = 200;
 
-	return 0;
+	DISPATCH(MISSION_COUNT, packet);
 }
 
 void msg_altitude() {
@@ -150,7 +339,7 @@ void msg_altitude() {
 	mw_altitude(&alt);
 
 	mavlink_msg_altitude_pack(1,200, &mav_msg,
-		current_time,
+		microsSinceEpoch(),
 		0.f, //monotonic
 		0.f, //amsl
 		0.f, //local
@@ -163,22 +352,30 @@ void msg_altitude() {
 }
 
 void msg_home_position() {
-	static uint8_t position_set = 1;
-	if (mw_state()==MAV_STATE_STANDBY) position_set = 0; //set home_position only in standby mode
-
-	if (position_set) return;
-
 	int32_t lat = 0;
 	int32_t lon = 0;
 	int32_t alt = 0;
 
-	float dummy[4];
-
-	mw_get_homepos(&lat,&lon,&alt);
-
-	mavlink_msg_home_position_pack(1,200, &mav_msg,
-		lat,lon, alt*10.f, 0.f, 0.f, 0.f, dummy, 0.f, 0.f, 0.f
-	);
+	mw_get_homepos(&lat,&lon,&alt); //refreshed by mw while in standby, zero until the board reports one
+	if (!lat && !lon) return;
+
+	mavlink_home_position_t packet;
+
+	packet.latitude = lat;
+	packet.longitude = lon;
+	packet.altitude = alt*10.f;
+	packet.x = 0.f;
+	packet.y = 0.f;
+	packet.z = 0.f;
+	packet.q[0] = 1.f; //no rotation
+	packet.q[1] = 0.f;
+	packet.q[2] = 0.f;
+	packet.q[3] = 0.f;
+	packet.approach_x = 0.f;
+	packet.approach_y = 0.f;
+	packet.approach_z = 0.f;
+
+	DISPATCH(HOME_POSITION, packet);
 }
 
 
@@ -191,12 +388,19 @@ void msg_global_position_int() {
 	mw_raw_gps(NULL, &lat, &lon, &alt, NULL, NULL, NULL);
 	mw_altitude(&ralt);
 
-	mavlink_msg_global_position_int_pack(1,200, &mav_msg,
-		current_time,
-		lat,lon, alt*10.f, ralt*10.f, 0.f, 0.f, 0.f, 0.f
-	);
+	mavlink_global_position_int_t packet;
 
-	dispatch(&mav_msg);
+	packet.time_boot_ms = microsSinceEpoch();
+	packet.lat = lat;
+	packet.lon = lon;
+	packet.alt = alt*10.f;
+	packet.relative_alt = ralt*10.f;
+	packet.vx = 0;
+	packet.vy = 0;
+	packet.vz = 0;
+	packet.hdg = 0;
+
+	DISPATCH(GLOBAL_POSITION_INT, packet);
 }
 
 void msg_gps_raw_int() {
@@ -212,12 +416,20 @@ void msg_gps_raw_int() {
 
 	mw_raw_gps(&fix, &lat, &lon, &alt, &vel, &cog, &satellites_visible);
 
-	mavlink_msg_gps_raw_int_pack(1,200, &mav_msg,
-		current_time,
-		fix,lat,lon, alt*10.f, eph, epv, vel, cog, satellites_visible
-	);
+	mavlink_gps_raw_int_t packet;
 
-	dispatch(&mav_msg);
+	packet.time_usec = microsSinceEpoch();
+	packet.fix_type = fix;
+	packet.lat = lat;
+	packet.lon = lon;
+	packet.alt = alt*10.f;
+	packet.eph = eph;
+	packet.epv = epv;
+	packet.vel = vel;
+	packet.cog = cog;
+	packet.satellites_visible = satellites_visible;
+
+	DISPATCH(GPS_RAW_INT, packet);
 }
 
 void msg_radio_status() {
@@ -226,106 +438,88 @@ void msg_radio_status() {
 	mw_get_signal(&rssi,&noise);
 
 	//printf("RSTATUS\n");
-	mavlink_msg_radio_status_pack(1,200, &mav_msg,
-		rssi, //rssi
-		-1, //remrssi
-		0, //txbuf
-		noise, //noise
-		0, //remnoise
-		0, //rxerrors
-		0 //fixed
-	);
-	dispatch(&mav_msg);
+	mavlink_radio_status_t packet;
+
+	packet.rssi = rssi;
+	packet.remrssi = -1;
+	packet.txbuf = udp_get_txbuf(); //our own link budget, same meaning as for the radios
+	packet.noise = noise;
+	packet.remnoise = 0;
+	packet.rxerrors = 0;
+	packet.fixed = 0;
+
+	DISPATCH(RADIO_STATUS, packet);
 }
 
 void msg_sys_status() {
 	static uint64_t prev_time = 0;
+	static uint32_t prev_manual = 0;
 
 	uint16_t vbat = mw_get_battery_voltage();
 	uint16_t amp = mw_get_battery_amp();
+	uint32_t sensors = mw_sys_status_sensors();
+
+	uint64_t current_time = microsSinceEpoch();
 
 	uint8_t dt_ms = (current_time - prev_time)/1000;
 	prev_time = current_time;
 
 
-	mavlink_msg_sys_status_pack(1, 200, &mav_msg,
-		mw_sys_status_sensors(), //present sensors
-		mw_sys_status_sensors(), //active sensors (assume all present are active for MW) //could use 0xFFFFFFFF ?
-		mw_sys_status_sensors(), //error sensors (assume all are ok for MW) //could use 0xFFFFFFFF ?
-		500, //load 50%
-		vbat*100, //voltage 11V
-		amp, //current
-		-1, //remaining
-		0,//mav_drop_rate(), //drop rate
-		0,//mav_drop_count(), //comm error count
-		mw_get_i2c_drop_count(), //errors_count1
-		manual_control_counter, //errors_count2
-		dt_ms/1000, //errors_count3
-		0 //errors_count4
-	);
-	dispatch(&mav_msg);	
+	mavlink_sys_status_t packet;
 
-	manual_control_counter = 0;
-}
+	packet.onboard_control_sensors_present = sensors; //present sensors
+	packet.onboard_control_sensors_enabled = sensors; //active sensors (assume all present are active for MW) //could use 0xFFFFFFFF ?
+	packet.onboard_control_sensors_health = sensors; //error sensors (assume all are ok for MW) //could use 0xFFFFFFFF ?
+	packet.load = 500; //load 50%
+	packet.voltage_battery = vbat*100; //voltage 11V
+	packet.current_battery = amp; //current
+	packet.battery_remaining = -1; //remaining
+	packet.drop_rate_comm = 0; //mav_drop_rate(), //drop rate
+	packet.errors_comm = 0; //mav_drop_count(), //comm error count
+	packet.errors_count1 = mw_get_i2c_drop_count();
+	packet.errors_count2 = rx_get_count(MAVLINK_MSG_ID_MANUAL_CONTROL) - prev_manual; //manual_control messages since the last sys_status
+	packet.errors_count3 = dt_ms/1000;
+	packet.errors_count4 = 0;
 
-void msg_heartbeat() {
+	DISPATCH(SYS_STATUS, packet);
 
-	mavlink_msg_heartbeat_pack(1, 200, &mav_msg, 
-		mw_type(),
-		MAV_AUTOPILOT_GENERIC,
-		mw_mode_flag(),
-		0,
-		mw_state()
-	);
-	dispatch(&mav_msg);
+	prev_manual = rx_get_count(MAVLINK_MSG_ID_MANUAL_CONTROL);
 }
 
-void msg_attitude_quaternion() {
-	float w,x,y,z;
+void msg_heartbeat() {
+	static uint8_t first = 1;
+	mavlink_heartbeat_t packet;
 
-	mw_attitude_quaternions(&w, &x, &y, &z);
+	packet.type = mw_type();
+	packet.autopilot = MAV_AUTOPILOT_GENERIC;
+	packet.base_mode = mw_mode_flag();
+	packet.custom_mode = 0;
+	packet.system_status = mw_state();
+	packet.mavlink_version = 3;
 
-	mavlink_msg_attitude_quaternion_pack(1,200, &mav_msg,
-		current_time,
-		w, x, y, z, 0.f, 0.f,0.f
-	);
+	DISPATCH(HEARTBEAT, packet);
 
-	dispatch(&mav_msg);
+	if (first) {
+		printf("First HEARTBEAT %u ms after start\n",(uint32_t)((event_now_us()-start_time)/1000));
+		first = 0;
+	}
 }
 
-void msg_manual_control(mavlink_message_t *msg) {
-	static uint16_t old_btn = 0;
-
-	manual_control_counter++;
-
-	uint16_t btn;
-	uint16_t i;
-	uint8_t btn_mapping;
-
-	int16_t t,y,p,r;
-	//TODO: check if msg timestamp is correct (>prev_timestamp)
-	t = mavlink_msg_manual_control_get_z(msg);
-	y = mavlink_msg_manual_control_get_r(msg);
-	p = mavlink_msg_manual_control_get_x(msg);
-	r = mavlink_msg_manual_control_get_y(msg);
-
-	btn=mavlink_msg_manual_control_get_buttons(msg);
-
-	if (btn!=old_btn) {
-
-		for (i=0;i<gamepad_button_count();i++) {
-			gamepad_get_mapping(&btn_mapping,i);
-			if (get_bit(old_btn,btn_mapping) && (get_bit(btn,btn_mapping)==0)) { gamepad_button_pressed(i); }
-		}
+void msg_attitude_quaternion() {
+	float w,x,y,z;
 
-		old_btn = btn;
-	}
+	mw_attitude_quaternions(&w, &x, &y, &z);
 
-	gamepad_control_calculate(&t,&y,&p,&r);
+	mavlink_attitude_quaternion_t packet;
 
-	mw_manual_control(t,y,p,r);
+	packet.time_boot_ms = microsSinceEpoch();
+	packet.q1 = w;
+	packet.q2 = x;
+	packet.q3 = y;
+	packet.q4 = z;
+	packet.rollspeed = 0.f;
+	packet.pitchspeed = 0.f;
+	packet.yawspeed = 0.f;
 
+	DISPATCH(ATTITUDE_QUATERNION, packet);
 }
-
-
-
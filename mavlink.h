@@ -9,20 +9,12 @@
 uint8_t mavlink_init();
 void mavlink_end();
 
-void mavlink_loop();
-
 void msg_command_long(mavlink_message_t *msg);
 
-void msg_param_set_pid(mavlink_message_t *msg);
-
-void msg_param_set(mavlink_message_t *msg);
-
-void msg_param_request_read(mavlink_message_t *msg);
-
-void msg_param_request_list(mavlink_message_t *msg);
+void msg_request_data_stream(mavlink_message_t *msg);
 
-uint8_t msg_mission_request_list(mavlink_message_t *msg);
+void msg_radio_status_in(mavlink_message_t *msg);
 
-void msg_manual_control(mavlink_message_t *msg);
+void msg_mission_request_list(mavlink_message_t *msg);
 
 #endif
\ No newline at end of file
@@ -42,6 +42,48 @@ static inline void crc_accumulate(uint8_t data, uint16_t *crcAccum)
 }
 #endif
 
+/*
+ * Buffers are hashed 8 bytes per step with lookup tables (slicing-by-8) unless
+ * crc_accumulate is provided externally or MAVLINK_CRC_BYTEWISE is defined.
+ */
+#if !defined(HAVE_CRC_ACCUMULATE) && !defined(MAVLINK_CRC_BYTEWISE)
+#define MAVLINK_CRC_SLICE8
+#include "checksum_table.h"
+
+/**
+ * @brief Accumulate the X.25 CRC over a byte array, 8 bytes per step
+ *
+ * The result is bit-identical to calling crc_accumulate() for every byte.
+ *
+ * @param crcAccum the already accumulated checksum
+ * @param p bytes to hash
+ * @param length number of bytes
+ **/
+static inline void crc_accumulate_slice8(uint16_t *crcAccum, const uint8_t *p, uint16_t length)
+{
+        uint16_t crc = *crcAccum;
+
+        while (length >= 8) {
+                crc = crc_table[7][p[0] ^ (crc & 0xff)] ^
+                      crc_table[6][p[1] ^ (crc >> 8)] ^
+                      crc_table[5][p[2]] ^
+                      crc_table[4][p[3]] ^
+                      crc_table[3][p[4]] ^
+                      crc_table[2][p[5]] ^
+                      crc_table[1][p[6]] ^
+                      crc_table[0][p[7]];
+                p += 8;
+                length -= 8;
+        }
+
+        while (length--) {
+                crc = (crc >> 8) ^ crc_table[0][(*p++ ^ crc) & 0xff];
+        }
+
+        *crcAccum = crc;
+}
+#endif
+
 
 /**
  * @brief Initiliaze the buffer for the X.25 CRC
@@ -65,9 +107,13 @@ static inline uint16_t crc_calculate(const uint8_t* pBuffer, uint16_t length)
 {
         uint16_t crcTmp;
         crc_init(&crcTmp);
+#ifdef MAVLINK_CRC_SLICE8
+        crc_accumulate_slice8(&crcTmp, pBuffer, length);
+#else
 	while (length--) {
                 crc_accumulate(*pBuffer++, &crcTmp);
         }
+#endif
         return crcTmp;
 }
 
@@ -84,9 +130,13 @@ static inline uint16_t crc_calculate(const uint8_t* pBuffer, uint16_t length)
 static inline void crc_accumulate_buffer(uint16_t *crcAccum, const char *pBuffer, uint16_t length)
 {
 	const uint8_t *p = (const uint8_t *)pBuffer;
+#ifdef MAVLINK_CRC_SLICE8
+        crc_accumulate_slice8(crcAccum, p, length);
+#else
 	while (length--) {
                 crc_accumulate(*p++, crcAccum);
         }
+#endif
 }
 
 #endif /* _CHECKSUM_H_ */
@@ -533,6 +533,156 @@ MAVLINK_HELPER uint8_t mavlink_parse_char(uint8_t chan, uint8_t c, mavlink_messa
     return msg_received;
 }
 
+/*
+ * Callback invoked by mavlink_parse_buffer() for every frame that passed the length and CRC checks.
+ * The message is only valid for the duration of the call.
+ */
+typedef void (*mavlink_parse_cb_t)(mavlink_message_t *msg);
+
+/*
+ * Internal function: validates and delivers the complete frames found in buf.
+ * Scanning stops at the first frame that is not complete yet; the number of bytes that were
+ * consumed is returned in *consumed so the caller can keep the tail for the next call.
+ */
+MAVLINK_HELPER uint16_t _mavlink_parse_frames(mavlink_status_t *status, const uint8_t *buf, uint16_t len,
+                                              uint16_t *consumed, mavlink_parse_cb_t cb)
+{
+#if MAVLINK_CRC_EXTRA
+	static const uint8_t mavlink_message_crcs[256] = MAVLINK_MESSAGE_CRCS;
+#endif
+#ifdef MAVLINK_CHECK_MESSAGE_LENGTH
+	static const uint8_t mavlink_message_lengths[256] = MAVLINK_MESSAGE_LENGTHS;
+#endif
+	mavlink_message_t msg;
+	const uint8_t *p, *end = buf + len;
+	uint16_t frames = 0;
+	uint16_t checksum;
+	uint8_t plen;
+
+	p = buf;
+	while (p < end) {
+		p = (const uint8_t *)memchr(p, MAVLINK_STX, end - p);
+		if (p == NULL) {
+			p = end;
+			break;
+		}
+
+		if (end - p < 2) break; // length not received yet
+		plen = p[1];
+
+#if (MAVLINK_MAX_PAYLOAD_LEN < 255)
+		if (plen > MAVLINK_MAX_PAYLOAD_LEN) {
+			status->buffer_overrun++;
+			status->parse_error++;
+			p++;
+			continue;
+		}
+#endif
+
+		if (end - p < MAVLINK_NUM_NON_PAYLOAD_BYTES + plen) break; // frame not complete yet
+
+#ifdef MAVLINK_CHECK_MESSAGE_LENGTH
+		if (plen != mavlink_message_lengths[p[5]]) {
+			status->parse_error++;
+			p++;
+			continue;
+		}
+#endif
+
+		checksum = crc_calculate(p + 1, MAVLINK_CORE_HEADER_LEN + plen);
+#if MAVLINK_CRC_EXTRA
+		crc_accumulate(mavlink_message_crcs[p[5]], &checksum);
+#endif
+		if (p[MAVLINK_NUM_HEADER_BYTES + plen] != (checksum & 0xFF) ||
+		    p[MAVLINK_NUM_HEADER_BYTES + plen + 1] != (checksum >> 8)) {
+			// resync on the next STX inside the rejected frame
+			status->parse_error++;
+			p++;
+			continue;
+		}
+
+		msg.checksum = checksum;
+		msg.magic = MAVLINK_STX;
+		msg.len = plen;
+		msg.seq = p[2];
+		msg.sysid = p[3];
+		msg.compid = p[4];
+		msg.msgid = p[5];
+		// payload followed by the two CRC bytes, as mavlink_frame_char_buffer() leaves it
+		memcpy(_MAV_PAYLOAD_NON_CONST(&msg), p + MAVLINK_NUM_HEADER_BYTES, plen + MAVLINK_NUM_CHECKSUM_BYTES);
+
+		status->current_rx_seq = msg.seq;
+		if (status->packet_rx_success_count == 0) status->packet_rx_drop_count = 0;
+		status->packet_rx_success_count++;
+
+		p += MAVLINK_NUM_NON_PAYLOAD_BYTES + plen;
+		frames++;
+		cb(&msg);
+	}
+
+	*consumed = p - buf;
+	return frames;
+}
+
+/**
+ * @brief Parse a block of received bytes and deliver every complete frame
+ *
+ * This is the bulk counterpart of mavlink_parse_char(). Instead of stepping a state machine
+ * for every byte, the buffer is searched for STX with memchr() and each candidate frame is
+ * checked for length and CRC at once. When a frame is rejected, parsing resumes at the next
+ * STX inside it, so a good frame following a corrupted or truncated one is not lost.
+ *
+ * A frame split across calls is kept in a per-channel carry buffer and completed by the
+ * next call. parse_error and buffer_overrun are counted in the channel status
+ * (mavlink_get_channel_status()). Every rejected STX is a parse error, including the ones
+ * inside a rejected frame, so on a noisy link parse_error grows faster than with
+ * mavlink_parse_char(), which skips the rest of a frame it has rejected.
+ * Do not mix this function with mavlink_parse_char() on the same channel.
+ *
+ * @param chan     ID of the current channel
+ * @param buf      received bytes
+ * @param len      number of bytes in buf
+ * @param cb       called for every good frame
+ * @return number of frames delivered
+ */
+MAVLINK_HELPER uint16_t mavlink_parse_buffer(uint8_t chan, const uint8_t *buf, uint16_t len, mavlink_parse_cb_t cb)
+{
+	// partial frame left over from the previous call, with room to append up to one more frame
+	static uint8_t carry[MAVLINK_COMM_NUM_BUFFERS][2*MAVLINK_MAX_PACKET_LEN];
+	static uint16_t carry_len[MAVLINK_COMM_NUM_BUFFERS];
+	mavlink_status_t *status = mavlink_get_channel_status(chan);
+	uint16_t frames = 0;
+	uint16_t consumed, take, old;
+
+	if (carry_len[chan]) {
+		// finish the carried frame first; one packet worth of new bytes is enough to complete it
+		old = carry_len[chan];
+		take = len < MAVLINK_MAX_PACKET_LEN ? len : MAVLINK_MAX_PACKET_LEN;
+		memcpy(carry[chan] + old, buf, take);
+		frames += _mavlink_parse_frames(status, carry[chan], old + take, &consumed, cb);
+
+		if (consumed < old) {
+			// still incomplete, which means all of buf has been appended
+			memmove(carry[chan], carry[chan] + consumed, old + take - consumed);
+			carry_len[chan] = old + take - consumed;
+			return frames;
+		}
+
+		carry_len[chan] = 0;
+		buf += consumed - old;
+		len -= consumed - old;
+	}
+
+	frames += _mavlink_parse_frames(status, buf, len, &consumed, cb);
+
+	if (consumed < len) {
+		carry_len[chan] = len - consumed;
+		memcpy(carry[chan], buf + consumed, carry_len[chan]);
+	}
+
+	return frames;
+}
+
 /**
  * @brief Put a bitfield of length 1-32 bit into the buffer
  *
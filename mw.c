@@ -1,6 +1,8 @@
 
 #include "mw.h"
 #include "global.h"
+#include "sched.h"
+#include "event.h"
 #include <mw/shm.h>
 #include <stdio.h>
 #include <math.h>
@@ -23,13 +25,131 @@ static struct S_MSP_WP homepos;
 static int16_t heading_initial=0;
 
 static struct S_MSG mw_msg;
-static struct S_MSP_STATUS status;
 static struct S_MSP_BOXCONFIG boxconf;
+
+//decoded copy of the latest response of every MSP message we read
+//it is refreshed once per tick and only when shm holds a response we have not seen yet
+struct _S_VEHICLE_STATE {
+	struct S_MSP_IDENT ident;
+	struct S_MSP_STATUS status;
+	struct S_MSP_ANALOG analog;
+	struct S_MSP_ALTITUDE altitude;
+	struct S_MSP_ATTITUDE attitude;
+	struct S_MSP_RAW_GPS gps;
+	struct S_MSP_LOCALSTATUS lstatus;
+	struct S_MSP_RC_TUNING rc_tuning;
+	struct S_MSP_MISC misc;
+	struct S_MSP_NAV_CONFIG nav;
+	struct S_MSP_PIDITEMS pid;
+	struct S_MSP_WP wp;
+
+	//derived once per response instead of on every read
+	uint8_t mav_type;
+	uint32_t sensors;
+	float q[4]; //attitude quaternion w,x,y,z
+};
+typedef struct _S_VEHICLE_STATE S_VEHICLE_STATE;
+
+static S_VEHICLE_STATE vehicle_state;
+static uint32_t state_gen[256]; //per MSP id, bumped on every new response
+
+#define STATE_COUNT 14
+static const uint8_t state_id[STATE_COUNT] = {
+	MSP_IDENT, MSP_STATUS, MSP_ANALOG, MSP_ALTITUDE, MSP_ATTITUDE, MSP_RAW_GPS, MSP_LOCALSTATUS,
+	MSP_RC_TUNING, MSP_MISC, MSP_NAV_CONFIG, MSP_PID, MSP_WP, MSP_BOX, MSP_BOXIDS
+};
 static struct S_MSP_RC rc = {.throttle=1000,.yaw=1500,.pitch=1500,.roll=1500,.aux1=1500,.aux2=1500,.aux3=1500,.aux4=1500};
 
+//startup handshake; all requests are sent at once and the responses are collected as they arrive
+#define HS_COUNT 7
+#define HS_RETRY_MS 250 //re-request items that were not answered
+#define HS_RETRY_LATE_MS 1000 //retry period once the deadline has passed
+
+struct _S_HANDSHAKE {
+	uint8_t id; //MSP message
+	uint8_t done;
+	uint32_t gen; //state generation when requested
+	uint64_t sent; //us
+};
+typedef struct _S_HANDSHAKE S_HANDSHAKE;
+
+static S_HANDSHAKE hs[HS_COUNT] = {
+	{MSP_IDENT}, {MSP_STATUS}, {MSP_MISC}, {MSP_RC_TUNING}, {MSP_BOXIDS}, {MSP_PID},
+	{MSP_NAV_CONFIG} //only when the board has gps
+};
+
+static uint16_t hs_deadline = 5000; //ms
+static uint64_t hs_start = 0;
+static uint8_t hs_ready = 0; //all answered or deadline passed
+static uint16_t hs_task = SCHED_NONE;
+
+/*
+	warm start: the board configuration the handshake collects is kept in MW_CACHE_FILE
+	on start it is decoded right away and mw_ready() holds while the handshake revalidates it in the background;
+	it belongs to the board with the same IDENT version and multitype, if another board answers the cache is
+	dropped and mw_ready() waits for the handshake as usual
+	only the configuration is kept, no status and no box states
+*/
+#define MW_CACHE_MAGIC 0x434d4d4du //"MMMC"
+#define MW_CACHE_VERSION 1
+
+struct _S_MW_CACHE {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size; //sizeof(S_MW_CACHE), changes with the msp library
+	struct S_MSP_IDENT ident; //key: version and multitype
+	struct S_MSP_MISC misc;
+	struct S_MSP_RC_TUNING rc_tuning;
+	struct S_MSP_PIDITEMS pid;
+	struct S_MSP_NAV_CONFIG nav;
+	uint8_t supported[CHECKBOXITEMS]; //MSP_BOXIDS
+	uint8_t has_nav;
+};
+typedef struct _S_MW_CACHE S_MW_CACHE;
+
+static S_MW_CACHE hs_cache; //as loaded or last saved
+static uint8_t hs_cached = 0; //running on the cache, not confirmed by the board yet
+
 #define RC_TIMEOUT 1000/LOOP_MS //1sec timeout for manual_control (see main loop for manual_control handling)
 static uint8_t rc_count;
 
+//cut-through: stick input is forwarded as soon as it arrives instead of waiting for mw_feed_rc
+static uint16_t rc_spacing = 0; //ms, minimum time between two SET_RAW_RC; 0 - periodic feed only
+static uint16_t rc_held_task = SCHED_NONE; //sends input held back by rc_spacing
+static uint64_t rc_sent = 0; //us
+static uint64_t rc_stamp = 0; //us, receive time of the newest input not in shm yet
+static S_HISTOGRAM rc_latency; //input received -> SET_RAW_RC in shm
+static uint32_t rc_direct = 0; //SET_RAW_RC sent straight from mw_manual_control
+static uint32_t rc_held = 0; //sent once the spacing elapsed
+static uint32_t rc_keepalive = 0; //sent by mw_feed_rc
+static t_rc_shaper rc_shaper = NULL; //see gamepad_shape
+
+/*
+	board writes: setters only change a copy of their MSP block; MW_WRITE_WINDOW_MS after the first change
+	every changed block goes out as one SET_* followed by one refresh, so a GCS uploading 30 PIDs costs
+	one write and one refresh of MSP_PID instead of 30 of each
+	with wr_commit set a batch is made permanent with a single EEPROM_WRITE
+	a copy stays the base of new changes until the refresh after its batch has landed, vehicle_state
+	only holds what the batch wrote from then on
+*/
+#define MW_WRITE_WINDOW_MS 50
+
+enum { WR_PID, WR_RC_TUNING, WR_MISC, WR_NAV_CONFIG, WR_COUNT };
+static const uint8_t wr_msp[WR_COUNT] = {MSP_PID, MSP_RC_TUNING, MSP_MISC, MSP_NAV_CONFIG};
+
+static struct S_MSP_PIDITEMS wr_pid;
+static struct S_MSP_RC_TUNING wr_rc_tuning;
+static struct S_MSP_MISC wr_misc;
+static struct S_MSP_NAV_CONFIG wr_nav;
+static uint8_t wr_dirty = 0; //bit per WR_*
+static uint8_t wr_flushed = 0; //bit per WR_*, sent but not refreshed yet
+static uint32_t wr_gen[WR_COUNT]; //state_gen of the block when its batch was sent
+static uint8_t wr_commit = 0;
+static uint16_t wr_task = SCHED_NONE; //one shot, enabled by the first change of a batch
+static uint32_t wr_changes = 0;
+static uint32_t wr_blocks = 0; //SET_* sent
+static uint32_t wr_commits = 0;
+
 void mw_keepalive();
 void mw_altitude_refresh();
 void mw_attitude_refresh();
@@ -37,131 +157,125 @@ void mw_gps_refresh();
 void mw_box_refresh();
 void mw_analog_refresh();
 void mw_feed_rc();
+void mw_rc_held();
+void mw_write_flush();
 void mw_standby();
 void mw_homepos_refresh();
 void do_failsafe();
 void mw_panic();
+void mw_state_refresh();
+void mw_handshake();
+static uint8_t state_poll(uint8_t id);
+static void mw_cache_load();
+static void mw_cache_save();
 typedef void (*t_cb)();
 
 struct _S_TASK {
-	uint16_t freq; //has to be less than loop_counter max value
+	uint16_t period; //ms
+	uint16_t phase; //ms, spreads tasks of the same period across ticks
 	t_cb cb_fn;
 };
 typedef struct _S_TASK S_TASK;
 
-#define MAX_TASK 10
+#define MAX_TASK 6
 
 static S_TASK task[MAX_TASK] = {
-	{1, mw_feed_rc}, //run every LOOP_MS (see global.h)
-	{100/LOOP_MS, mw_panic}, //run every X miliseconds
-	{100/LOOP_MS, mw_standby},
-	{500/LOOP_MS, mw_altitude_refresh},
-	{100/LOOP_MS, mw_attitude_refresh},
-	{500/LOOP_MS, mw_gps_refresh},
-	{1000/LOOP_MS, mw_keepalive},
-	{1000/LOOP_MS, mw_box_refresh},
-	{1000/LOOP_MS, mw_analog_refresh},
-	{500/LOOP_MS, do_failsafe} //ensure it runs every 500ms
+	{LOOP_MS, 0, mw_state_refresh}, //run every LOOP_MS (see global.h)
+	{LOOP_MS, 0, mw_feed_rc},
+	{100, 0, mw_panic}, //run every X miliseconds
+	{100, 50, mw_standby},
+	{1000, 0, mw_keepalive},
+	{500, 125, do_failsafe} //ensure it runs every 500ms
 };
 
+//data polled on demand; the poll period follows the fastest consumer (see mw_demand_set), 0 - nobody reads it
+struct _S_SOURCE {
+	uint8_t id; //MSP message
+	uint16_t min_period; //ms, never polled faster than this
+	t_cb cb_fn;
+	uint16_t task; //scheduler task
+	uint16_t period; //ms, current poll period
+};
+typedef struct _S_SOURCE S_SOURCE;
 
-void mw_loop() { //
-	static uint8_t counter = 0;
-	uint8_t i;
+#define SOURCE_COUNT 5
 
-	for (i=0;i<MAX_TASK;i++)
-		if (counter%task[i].freq==0) {
-			task[i].cb_fn();
-		}
+static S_SOURCE source[SOURCE_COUNT] = {
+	{MSP_ATTITUDE, 20, mw_attitude_refresh},
+	{MSP_ALTITUDE, 100, mw_altitude_refresh},
+	{MSP_RAW_GPS, 200, mw_gps_refresh},
+	{MSP_ANALOG, 500, mw_analog_refresh},
+	{MSP_BOX, 200, mw_box_refresh}
+};
 
-	counter++;
-	if (counter==100) counter=0;
+struct _S_DEMAND {
+	uint8_t src; //index to source
+	uint16_t period; //ms, 0 - not consuming
+};
+typedef struct _S_DEMAND S_DEMAND;
 
-}
+#define MAX_DEMAND 32
+
+static S_DEMAND demand[MAX_DEMAND];
+static uint8_t demand_count = 0;
+
+static uint8_t standby_demand; //heading is taken from the attitude while in standby
+static uint8_t failsafe_demand; //box state is needed for rth during failsafe
 
 uint8_t mw_init() {
  	if (shm_client_init()) return -1; 
 
-	//this retrievs the initial set of settings from MW like boxconfiguration, etc
-	uint8_t filter;
+	uint8_t i;
 
 	rc_count = 0;
-	//ident
-	filter = MSP_IDENT;
-	shm_scan_incoming_f(&mw_msg,&filter,1); //invalidate
-	while (1) {
-		mspmsg_IDENT_serialize(&mw_msg);
-		shm_put_outgoing(&mw_msg);
-		mssleep(50);
-		if (shm_scan_incoming_f(&mw_msg,&filter,1)) break; //got the response
-	} 
+	rc_sent = 0;
+	rc_stamp = 0;
+	histogram_reset(&rc_latency);
+	rc_held_task = sched_add(mw_rc_held,0,0); //one shot, enabled when input is held back
+	wr_dirty = 0;
+	wr_flushed = 0;
+	wr_task = sched_add(mw_write_flush,0,0);
+	memset(&vehicle_state,0,sizeof(vehicle_state));
+	memset(state_gen,0,sizeof(state_gen));
 
-	//status
-	filter = MSP_STATUS;
-	shm_scan_incoming_f(&mw_msg,&filter,1); //invalidate
-	while (1) {
-		mspmsg_STATUS_serialize(&mw_msg);
-		shm_put_outgoing(&mw_msg);
-		mssleep(50);
-		if (shm_scan_incoming_f(&mw_msg,&filter,1)) break; //got the response
-	}
-	mspmsg_STATUS_parse(&status,&mw_msg);
-
-	filter = MSP_MISC;
-	shm_scan_incoming_f(&mw_msg,&filter,1); //invalidate
-	while (1) {
-		mspmsg_MISC_serialize(&mw_msg);
-		shm_put_outgoing(&mw_msg);
-		mssleep(50);
-		if (shm_scan_incoming_f(&mw_msg,&filter,1)) break; //got the response
-	} 	
-
-	filter = MSP_RC_TUNING;
-	shm_scan_incoming_f(&mw_msg,&filter,1); //invalidate
-	while (1) {
-		mspmsg_RC_TUNING_serialize(&mw_msg);
-		shm_put_outgoing(&mw_msg);
-		mssleep(50);
-		if (shm_scan_incoming_f(&mw_msg,&filter,1)) break; //got the response
-	} 	
-
-	filter = MSP_BOXIDS;
-	shm_scan_incoming_f(&mw_msg,&filter,1); //invalidate
-	while (1) {
-		mspmsg_BOXIDS_serialize(&mw_msg);
-		shm_put_outgoing(&mw_msg);
-		mssleep(50);
-		if (shm_scan_incoming_f(&mw_msg,&filter,1)) {
-			mspmsg_BOXIDS_parse(&boxconf,&mw_msg);
-			break; //got the response
-		}
-	} 	
+	failsafe_mode = 0;
 
-	mspmsg_BOX_serialize(&mw_msg);
-	shm_put_outgoing(&mw_msg);	
+	for (i=0;i<MAX_TASK;i++)
+		sched_add(task[i].cb_fn,task[i].period,task[i].phase);
 
-	if (msp_has_gps(&status)) {
-		filter = MSP_NAV_CONFIG;
-		shm_scan_incoming_f(&mw_msg,&filter,1); //invalidate
-		while (1) {
-			mspmsg_NAV_CONFIG_serialize(&mw_msg);
-			shm_put_outgoing(&mw_msg);
-			mssleep(50);
-			if (shm_scan_incoming_f(&mw_msg,&filter,1)) break; //got the response
-		} 
+	demand_count = 0;
+	for (i=0;i<SOURCE_COUNT;i++) {
+		source[i].period = 0;
+		source[i].task = sched_add(source[i].cb_fn,0,0); //enabled once somebody needs the data
 	}
+	standby_demand = mw_demand_add(MSP_ATTITUDE);
+	failsafe_demand = mw_demand_add(MSP_BOX);
 
+	mw_cache_load(); //before the handshake takes its generations, so it still waits for the board
 
-	failsafe_mode = 0;
+	//the initial set of settings (boxconfiguration, etc) is retrieved in the background, see mw_handshake
+	for (i=0;i<HS_COUNT;i++) {
+		hs[i].done = 0;
+		hs[i].sent = 0;
+		state_poll(hs[i].id); //invalidate
+		hs[i].gen = state_gen[hs[i].id];
+	}
+	hs_start = event_now_us();
+	hs_ready = 0;
+	hs_task = sched_add(mw_handshake, LOOP_MS, 0);
+	mw_handshake(); //all requests go out at once
 
 	return 0;
 }
 
 void mw_end() {
+	mw_write_flush(); //a batch still in its window
  	shm_client_end(); //close channel to mw-service	
 }
 
 void do_failsafe() { //runs in a loop every 500ms
+	mw_demand_set(failsafe_demand, failsafe?500:0);
+
 	if (!failsafe) {
 		return; //failsafe not requested, do nothing
 	} 
@@ -223,14 +337,51 @@ void failsafe_reset() {
 	shm_put_outgoing(&mw_msg);	
 }
 
+static void rc_send() {
+	uint64_t now = event_now_us();
+
+	if (rc_shaper && !suppress_rc) rc_shaper(now, &rc);
+	mspmsg_SET_RAW_RC_serialize(&mw_msg,&rc);
+	shm_put_outgoing(&mw_msg);
+
+	rc_sent = now;
+	if (rc_stamp) {
+		histogram_add(&rc_latency, now>rc_stamp?now-rc_stamp:0);
+		rc_stamp = 0;
+	}
+}
+
+void mw_set_rc_cut_through(uint16_t spacing_ms) {
+	rc_spacing = spacing_ms;
+}
+
+void mw_set_rc_shaper(t_rc_shaper cb) {
+	rc_shaper = cb;
+}
+
+void mw_set_write_commit(uint8_t commit) {
+	wr_commit = commit;
+}
+
+void mw_rc_held() {
+	sched_set_period(rc_held_task, 0);
+	if (!rc_stamp) return; //the feed got there first
+
+	rc_held++;
+	rc_send();
+}
+
 void mw_feed_rc() {
 	//this is run from a loop
 	if (rc_count==0) return; //dont feed rc if we have nothing to feed
 	
 	rc_count--;
 
-	mspmsg_SET_RAW_RC_serialize(&mw_msg,&rc);
-	shm_put_outgoing(&mw_msg);
+	//with cut-through the feed is only a keep-alive for when the sticks go quiet
+	if (!rc_spacing || event_now_us()-rc_sent>=LOOP_MS*1000) {
+		if (rc_spacing) rc_keepalive++;
+		rc_send();
+	}
 
 	if (rc_count==0) { //rc has just timed-out 
 		failsafe_initiate();
@@ -238,6 +389,8 @@ void mw_feed_rc() {
 }
 
 void mw_standby() {
+	mw_demand_set(standby_demand, mw_status==0?500:0); //heading on the ground does not need a fast refresh
+
 	if (mw_status!=0) return; //not in standby
 
 	failsafe = 0;
@@ -245,24 +398,383 @@ void mw_standby() {
 	mw_homepos_refresh();
 
 	//attitude is getting monitored in standby anyway so take the heading
-	struct S_MSP_ATTITUDE attitude;
-	
-	shm_get_incoming(&mw_msg,MSP_ATTITUDE);
-	mspmsg_ATTITUDE_parse(&attitude,&mw_msg);
-	heading_initial = attitude.heading;
+	heading_initial = vehicle_state.attitude.heading;
+}
+
+/* ============== VEHICLE STATE ==============  */
+static uint8_t mw_type_decode(uint8_t multitype) {
+	switch (multitype) {
+
+		case MULTITYPETRI: return MAV_TYPE_TRICOPTER;
+
+		case MULTITYPEVTAIL4: return MAV_TYPE_VTOL_QUADROTOR;
+
+		case MULTITYPEY4:
+		case MULTITYPEQUADP: 
+		case MULTITYPEQUADX: return MAV_TYPE_QUADROTOR;
+
+		case MULTITYPEY6:
+		case MULTITYPEHEX6:
+		case MULTITYPEHEX6H:
+		case MULTITYPEHEX6X: return MAV_TYPE_HEXAROTOR;
+
+		case MULTITYPEOCTOFLATP:
+		case MULTITYPEOCTOFLATX:
+		case MULTITYPEOCTOX8: return MAV_TYPE_OCTOROTOR;
+
+		case MULTITYPEGIMBAL: return MAV_TYPE_GIMBAL;
+
+		case MULTITYPEAIRPLANE:
+		case MULTITYPEFLYING_WING: return MAV_TYPE_FIXED_WING;
+
+		case MULTITYPEHELI_120_CCPM:
+		case MULTITYPEHELI_90_DEG: return MAV_TYPE_HELICOPTER;
+
+		case MULTITYPEBI:
+		case MULTITYPEDUALCOPTER: return MAV_TYPE_VTOL_DUOROTOR;
+
+		case MULTITYPESINGLECOPTER:
+		case MULTITYPENONE0:		
+		case MULTITYPENONE19:
+		default: return MAV_TYPE_GENERIC;	
+	}
+}
+
+static uint32_t mw_sensors_decode(uint16_t sensor) {
+	//we take it from status message
+	uint32_t ret = 0;
+//	struct S_MSP_BOXCONFIG boxconfig;
+
+/*
+	shm_get_incoming(&mw_msg,MSP_BOXIDS);
+	mspmsg_BOXIDS_parse(&boxconfig,&mw_msg);
+*/
+
+	ret = MAV_SYS_STATUS_SENSOR_3D_GYRO; //assume we always have gyro
+
+	ret |= MAV_SYS_STATUS_SENSOR_YAW_POSITION; 
+
+	if (get_bit(sensor,0)) ret |= (MAV_SYS_STATUS_SENSOR_3D_ACCEL | MAV_SYS_STATUS_SENSOR_ATTITUDE_STABILIZATION);	//acc
+	if (get_bit(sensor,1)) ret |= MAV_SYS_STATUS_SENSOR_Z_ALTITUDE_CONTROL;	//baro
+	if (get_bit(sensor,2)) ret |= MAV_SYS_STATUS_SENSOR_3D_MAG;	//mag
+	if (get_bit(sensor,3)) ret |= MAV_SYS_STATUS_SENSOR_GPS; 	//gps
+	if (get_bit(sensor,4)) ret |= MAV_SYS_STATUS_SENSOR_Z_ALTITUDE_CONTROL;	//sonar
+
+	return ret;
+}
+
+static void mw_quaternion_decode(struct S_MSP_ATTITUDE *attitude, float *q) {
+	//printf("yaw: %i x: %i y: %i\n",attitude->heading,attitude->angx/10,attitude->angy/10);
+
+	float a = (M_PI / 180) * attitude->angx/10.f;
+	float b = (M_PI / 180) * attitude->heading;
+	float c = -(M_PI / 180) * attitude->angy/10.f;
+
+    double c1 = cos(a/2);
+    double s1 = sin(a/2);
+    double c2 = cos(b/2);
+    double s2 = sin(b/2);
+    double c3 = cos(c/2);
+    double s3 = sin(c/2);
+    double c1c2 = c1*c2;
+    double s1s2 = s1*s2;
+	q[0] = c1c2*c3 - s1s2*s3;
+	q[1] = c1c2*s3 + s1s2*c3;
+	q[2] = s1*c2*c3 + c1*s2*s3;
+	q[3] = c1*s2*c3 - s1*c2*s3;
+}
+
+static void state_decode(uint8_t id) {
+	S_VEHICLE_STATE *v = &vehicle_state;
+
+	switch (id) {
+		case MSP_IDENT:
+			mspmsg_IDENT_parse(&v->ident,&mw_msg);
+			v->mav_type = mw_type_decode(v->ident.multitype);
+			if (hs_cached && (v->ident.version!=hs_cache.ident.version || v->ident.multitype!=hs_cache.ident.multitype)) {
+				printf("MW board changed (version %u type %u), dropping the cached configuration\n",v->ident.version,v->ident.multitype);
+				hs_cached = 0;
+			}
+			break;
+		case MSP_STATUS:
+			mspmsg_STATUS_parse(&v->status,&mw_msg);
+			v->sensors = mw_sensors_decode(v->status.sensor);
+			break;
+		case MSP_ANALOG: mspmsg_ANALOG_parse(&v->analog,&mw_msg); break;
+		case MSP_ALTITUDE: mspmsg_ALTITUDE_parse(&v->altitude,&mw_msg); break;
+		case MSP_ATTITUDE:
+			mspmsg_ATTITUDE_parse(&v->attitude,&mw_msg);
+			mw_quaternion_decode(&v->attitude,v->q);
+			break;
+		case MSP_RAW_GPS: mspmsg_RAW_GPS_parse(&v->gps,&mw_msg); break;
+		case MSP_LOCALSTATUS: mspmsg_LOCALSTATUS_parse(&v->lstatus,&mw_msg); break;
+		case MSP_RC_TUNING: mspmsg_RC_TUNING_parse(&v->rc_tuning,&mw_msg); break;
+		case MSP_MISC: mspmsg_MISC_parse(&v->misc,&mw_msg); break;
+		case MSP_NAV_CONFIG: mspmsg_NAV_CONFIG_parse(&v->nav,&mw_msg); break;
+		case MSP_PID: mspmsg_PID_parse(&v->pid,&mw_msg); break;
+		case MSP_WP: mspmsg_WP_parse(&v->wp,&mw_msg); break;
+		case MSP_BOX: mspmsg_BOX_parse(&boxconf,&mw_msg); break;
+		case MSP_BOXIDS: mspmsg_BOXIDS_parse(&boxconf,&mw_msg); break;
+	}
+
+	state_gen[id]++;
+}
+
+//picks up a new response for id if there is one; returns 1 if the state got updated
+static uint8_t state_poll(uint8_t id) {
+	uint8_t filter = id;
+
+	if (!shm_scan_incoming_f(&mw_msg,&filter,1)) return 0;
+
+	state_decode(id);
+	return 1;
+}
+
+//the only place that consumes responses from shm, all getters read the decoded state
+void mw_state_refresh() {
+	uint8_t i;
+
+	for (i=0;i<STATE_COUNT;i++)
+		state_poll(state_id[i]);
+}
+
+uint32_t mw_state_gen(uint8_t msp_id) {
+	return state_gen[msp_id];
+}
+/* ============== END VEHICLE STATE ==============  */
+
+/* ============== HANDSHAKE ==============  */
+static void hs_request(uint8_t id) {
+	switch (id) {
+		case MSP_IDENT: mspmsg_IDENT_serialize(&mw_msg); break;
+		case MSP_STATUS: mspmsg_STATUS_serialize(&mw_msg); break;
+		case MSP_MISC: mspmsg_MISC_serialize(&mw_msg); break;
+		case MSP_RC_TUNING: mspmsg_RC_TUNING_serialize(&mw_msg); break;
+		case MSP_BOXIDS: mspmsg_BOXIDS_serialize(&mw_msg); break;
+		case MSP_PID: mspmsg_PID_serialize(&mw_msg); break;
+		case MSP_NAV_CONFIG: mspmsg_NAV_CONFIG_serialize(&mw_msg); break;
+		default: return;
+	}
+	shm_put_outgoing(&mw_msg);
+
+	if (id==MSP_BOXIDS) { //box values are needed together with the ids
+		mspmsg_BOX_serialize(&mw_msg);
+		shm_put_outgoing(&mw_msg);
+	}
+}
+
+//decodes MW_CACHE_FILE into vehicle_state, once from mw_init
+static void mw_cache_load() {
+	S_VEHICLE_STATE *v = &vehicle_state;
+	FILE *f;
+
+	hs_cached = 0;
+	memset(&hs_cache,0,sizeof(hs_cache));
+
+	f = fopen(MW_CACHE_FILE,"rb");
+	if (!f) return;
+
+	if (fread(&hs_cache,sizeof(hs_cache),1,f)!=1 || hs_cache.magic!=MW_CACHE_MAGIC
+		|| hs_cache.version!=MW_CACHE_VERSION || hs_cache.size!=sizeof(hs_cache)) {
+		printf("MW cache invalid, ignoring.\n");
+		memset(&hs_cache,0,sizeof(hs_cache));
+		fclose(f);
+		return;
+	}
+	fclose(f);
+
+	v->ident = hs_cache.ident;
+	v->mav_type = mw_type_decode(v->ident.multitype);
+	v->misc = hs_cache.misc;
+	v->rc_tuning = hs_cache.rc_tuning;
+	v->pid = hs_cache.pid;
+	memcpy(boxconf.supported,hs_cache.supported,sizeof(boxconf.supported));
+
+	//consumers see it like any other response
+	state_gen[MSP_IDENT]++;
+	state_gen[MSP_MISC]++;
+	state_gen[MSP_RC_TUNING]++;
+	state_gen[MSP_PID]++;
+	state_gen[MSP_BOXIDS]++;
+	if (hs_cache.has_nav) {
+		v->nav = hs_cache.nav;
+		state_gen[MSP_NAV_CONFIG]++;
+	}
+
+	hs_cached = 1;
+	printf("MW configuration loaded from cache (version %u type %u), revalidating\n",v->ident.version,v->ident.multitype);
+}
+
+//written once the handshake is complete, only if the configuration differs from the cache
+static void mw_cache_save() {
+	S_VEHICLE_STATE *v = &vehicle_state;
+	S_MW_CACHE c;
+	FILE *f;
+	uint8_t ok;
+
+	memset(&c,0,sizeof(c));
+	c.magic = MW_CACHE_MAGIC;
+	c.version = MW_CACHE_VERSION;
+	c.size = sizeof(c);
+	c.ident = v->ident;
+	c.misc = v->misc;
+	c.rc_tuning = v->rc_tuning;
+	c.pid = v->pid;
+	memcpy(c.supported,boxconf.supported,sizeof(c.supported));
+	c.has_nav = msp_has_gps(&v->status);
+	if (c.has_nav) c.nav = v->nav;
+
+	if (!memcmp(&c,&hs_cache,sizeof(c))) return;
+
+	f = fopen(MW_CACHE_FILE".tmp","wb");
+	if (!f) return;
+
+	ok = (fwrite(&c,sizeof(c),1,f)==1);
+	if (fclose(f) || !ok || rename(MW_CACHE_FILE".tmp",MW_CACHE_FILE)) {
+		printf("Error while writing MW cache.\n");
+		unlink(MW_CACHE_FILE".tmp");
+		return;
+	}
+
+	hs_cache = c;
+}
+
+//runs every LOOP_MS until every handshake item has been answered
+void mw_handshake() {
+	S_HANDSHAKE *h;
+	uint64_t now = event_now_us();
+	uint32_t elapsed = (now-hs_start)/1000;
+	uint16_t retry = hs_ready?HS_RETRY_LATE_MS:HS_RETRY_MS;
+	uint8_t i, missing = 0;
+
+	for (i=0;i<HS_COUNT;i++) {
+		h = &hs[i];
+		if (h->done) continue;
+
+		if (state_gen[h->id]!=h->gen) { //answered, the state refresh has already decoded it
+			h->done = 1;
+			continue;
+		}
+
+		if (h->id==MSP_NAV_CONFIG) {
+			if (!state_gen[MSP_STATUS]) { //wait for the status to know if there is gps
+				missing++;
+				continue;
+			}
+			if (!msp_has_gps(&vehicle_state.status)) {
+				h->done = 1;
+				continue;
+			}
+		}
+
+		missing++;
+		if (!h->sent || (now-h->sent)>=(uint64_t)retry*1000) {
+			hs_request(h->id);
+			h->sent = now;
+		}
+	}
+
+	if (!missing) {
+		printf("MW handshake complete in %u ms, params available %u ms after start\n",
+			elapsed, (uint32_t)((now-start_time)/1000));
+		hs_ready = 1;
+		hs_cached = 0;
+		mw_cache_save();
+		sched_set_period(hs_task, 0);
+		return;
+	}
+
+	if (!hs_ready && elapsed>=hs_deadline) {
+		printf("MW handshake deadline (%u ms) passed, missing:",hs_deadline);
+		for (i=0;i<HS_COUNT;i++)
+			if (!hs[i].done) printf(" %u",hs[i].id);
+		printf(". Continuing with partial data.\n");
+		hs_ready = 1; //keep retrying in the background
+	}
 }
 
+uint8_t mw_ready() {
+	return hs_ready || hs_cached;
+}
+
+void mw_set_handshake_deadline(uint16_t ms) {
+	hs_deadline = ms;
+}
+/* ============== END HANDSHAKE ==============  */
+
+/* ============== DEMAND DRIVEN POLLING ==============  */
+static void source_update(uint8_t s) {
+	uint16_t period = 0;
+	uint8_t i;
+
+	for (i=0;i<demand_count;i++) {
+		if (demand[i].src!=s || !demand[i].period) continue;
+		if (!period || demand[i].period<period) period = demand[i].period;
+	}
+
+	if (period && period<source[s].min_period) period = source[s].min_period;
+
+	source[s].period = period;
+	sched_set_period(source[s].task, period);
+}
+
+uint8_t mw_demand_add(uint8_t msp_id) {
+	uint8_t i;
+
+	if (demand_count>=MAX_DEMAND) return UINT8_MAX;
+
+	for (i=0;i<SOURCE_COUNT;i++)
+		if (source[i].id==msp_id) {
+			demand[demand_count].src = i;
+			demand[demand_count].period = 0;
+			return demand_count++;
+		}
+
+	return UINT8_MAX; //not polled on demand
+}
+
+uint16_t mw_demand_set(uint8_t handle, uint16_t period_ms) {
+	S_DEMAND *d;
+
+	if (handle>=demand_count) return 0;
+	d = &demand[handle];
+
+	if (d->period!=period_ms) {
+		d->period = period_ms;
+		source_update(d->src);
+	}
+
+	return source[d->src].min_period;
+}
+
+void mw_print_stats() {
+	uint8_t i;
+
+	printf("MSP polling:");
+	for (i=0;i<SOURCE_COUNT;i++)
+		printf(" %u=%ums",source[i].id,source[i].period);
+	printf("\n");
+
+	if (rc_spacing) {
+		printf("RC cut-through: spacing=%ums direct=%u held=%u keepalive=%u\n",rc_spacing,rc_direct,rc_held,rc_keepalive);
+		histogram_print("RC latency (cut-through)",&rc_latency);
+	} else histogram_print("RC latency (periodic feed)",&rc_latency);
+
+	printf("Board writes: changes=%u blocks=%u commits=%u\n",wr_changes,wr_blocks,wr_commits);
+}
+/* ============== END DEMAND DRIVEN POLLING ==============  */
+
 /* ============== REFRESH FUNCTIONS ==============  */
 void mw_homepos_refresh() {
+	static uint32_t gen = 0;
 	struct S_MSP_WP wp;
-	uint8_t filter;
 
 	mspmsg_WP_serialize(&mw_msg,0);
 	shm_put_outgoing(&mw_msg);
 
-	filter = MSP_WP;
-	if (shm_scan_incoming_f(&mw_msg,&filter,1)) {
-		mspmsg_WP_parse(&wp,&mw_msg);
+	if (gen!=state_gen[MSP_WP]) { //got a response since the last refresh
+		gen = state_gen[MSP_WP];
+		wp = vehicle_state.wp;
 		if ((wp.wp_no==0) && (wp.lat!=0) && (wp.lon!=0)) {
 			homepos=wp;
 			has_homepos = 1;
@@ -273,12 +785,9 @@ void mw_homepos_refresh() {
 }
 
 
-void mw_box_refresh() {
+void mw_box_refresh() { //the response is decoded into boxconf by mw_state_refresh
 	mspmsg_BOX_serialize(&mw_msg);
 	shm_put_outgoing(&mw_msg);	
-
-	shm_get_incoming(&mw_msg,MSP_BOX);
-	mspmsg_BOX_parse(&boxconf,&mw_msg);
 }
 
 void mw_analog_refresh() {
@@ -304,7 +813,7 @@ void mw_gps_refresh() {
 void mw_keepalive() {
 	//keep alive for MultiWii and the service
 	static uint8_t err_counter = 0; //number of missed status messages
-	uint8_t filter;
+	static uint32_t gen = 0;
 
 	mspmsg_LOCALSTATUS_serialize(&mw_msg,NULL);
 	shm_put_outgoing(&mw_msg);	
@@ -312,12 +821,11 @@ void mw_keepalive() {
 	mspmsg_STATUS_serialize(&mw_msg);
 	shm_put_outgoing(&mw_msg);
 
-	filter = MSP_STATUS;
-	if (!shm_scan_incoming_f(&mw_msg,&filter,1)) err_counter++;
+	if (gen==state_gen[MSP_STATUS]) err_counter++; //no status since the last keepalive
 	else {
-		mspmsg_STATUS_parse(&status,&mw_msg);
+		gen = state_gen[MSP_STATUS];
 		err_counter = 0;
-		if (msp_is_armed(&status)) mw_status=1;
+		if (msp_is_armed(&vehicle_state.status)) mw_status=1;
 		else mw_status = 0;
 	}
 
@@ -329,7 +837,7 @@ void mw_keepalive() {
 //re-requests pid values and names
 //if reset is set - re-request is issues
 uint8_t mw_pid_refresh(uint8_t reset) {
-	uint8_t filter;
+	static uint32_t gen = 0;
 	static uint8_t state = 0;
 	static uint8_t got_pid = 0;
 	static uint8_t got_pidnames = 0;
@@ -349,8 +857,8 @@ uint8_t mw_pid_refresh(uint8_t reset) {
 			//filter = MSP_PIDNAMES;
 			//shm_scan_incoming_f(&mw_msg,&filter,1));
 
-			filter = MSP_PID;
-			shm_scan_incoming_f(&mw_msg,&filter,1);
+			state_poll(MSP_PID);
+			gen = state_gen[MSP_PID];
 			
 			//re-request
 			//mspmsg_PIDNAMES_serialize(&mw_msg,NULL);
@@ -365,8 +873,7 @@ uint8_t mw_pid_refresh(uint8_t reset) {
 			//filter = MSP_PIDNAMES;
 			//if (shm_scan_incoming_f(&mw_msg,&filter,1)) got_pidnames=1;
 			got_pidnames=1;
-			filter = MSP_PID;
-			if (shm_scan_incoming_f(&mw_msg,&filter,1)) {
+			if (gen!=state_gen[MSP_PID]) {
 				got_pid=1;
 				state = 2;
 			}
@@ -404,29 +911,95 @@ void mw_disarm() {
 }
 
 void mw_eeprom_write(uint8_t *dummy) {
+	mw_write_flush(); //the changes still in their window have to be part of it
+
 	mspmsg_EEPROM_WRITE_serialize(&mw_msg);
 	shm_put_outgoing(&mw_msg);	
 }
 
+//1 if a change has to start from vehicle_state instead of the copy of the block
+static uint8_t mw_write_reseed(uint8_t block) {
+	if (wr_dirty & (1<<block)) return 0; //batch being collected
+	if ((wr_flushed & (1<<block)) && state_gen[wr_msp[block]]==wr_gen[block]) return 0; //vehicle_state predates the batch
+
+	wr_flushed &= ~(1<<block);
+	return 1;
+}
+
+static void mw_write_queue(uint8_t block) {
+	wr_dirty |= 1<<block;
+	wr_changes++;
+	if (!sched_get_period(wr_task)) sched_set_period(wr_task, MW_WRITE_WINDOW_MS);
+}
+
+//sends the batch: writes first, then the commit, then the refreshes so they report what the board stored
+void mw_write_flush() {
+	uint8_t i;
+
+	sched_set_period(wr_task, 0);
+	if (!wr_dirty) return;
+
+	if (wr_dirty & (1<<WR_PID)) {
+		mspmsg_SET_PID_serialize(&mw_msg,&wr_pid);
+		shm_put_outgoing(&mw_msg);
+		wr_blocks++;
+	}
+	if (wr_dirty & (1<<WR_RC_TUNING)) {
+		mspmsg_SET_RC_TUNING_serialize(&mw_msg,&wr_rc_tuning);
+		shm_put_outgoing(&mw_msg);
+		wr_blocks++;
+	}
+	if (wr_dirty & (1<<WR_MISC)) {
+		mspmsg_SET_MISC_serialize(&mw_msg,&wr_misc);
+		shm_put_outgoing(&mw_msg);
+		wr_blocks++;
+	}
+	if (wr_dirty & (1<<WR_NAV_CONFIG)) {
+		mspmsg_NAV_CONFIG_SET_serialize(&mw_msg,&wr_nav);
+		shm_put_outgoing(&mw_msg);
+		wr_blocks++;
+	}
+
+	if (wr_commit) {
+		mspmsg_EEPROM_WRITE_serialize(&mw_msg);
+		shm_put_outgoing(&mw_msg);
+		wr_commits++;
+	}
+
+	if (wr_dirty & (1<<WR_PID)) mw_pid_refresh(1);
+	if (wr_dirty & (1<<WR_RC_TUNING)) {
+		mspmsg_RC_TUNING_serialize(&mw_msg);
+		shm_put_outgoing(&mw_msg);
+	}
+	if (wr_dirty & (1<<WR_MISC)) {
+		mspmsg_MISC_serialize(&mw_msg);
+		shm_put_outgoing(&mw_msg);
+	}
+	if (wr_dirty & (1<<WR_NAV_CONFIG)) {
+		mspmsg_NAV_CONFIG_serialize(&mw_msg);
+		shm_put_outgoing(&mw_msg);
+	}
+
+	for (i=0;i<WR_COUNT;i++)
+		if (wr_dirty & (1<<i)) {
+			wr_flushed |= 1<<i;
+			wr_gen[i] = state_gen[wr_msp[i]];
+		}
+
+	wr_dirty = 0;
+}
+
 uint16_t mw_get_i2c_drop_count() {
 	//this get count of errors on MW->MW_SERVICE link only
-	struct S_MSP_LOCALSTATUS lstatus;
-	
-	shm_get_incoming(&mw_msg,MSP_LOCALSTATUS);
-	mspmsg_LOCALSTATUS_parse(&lstatus,&mw_msg);	
-
-	return lstatus.crc_error_count;
+	return vehicle_state.lstatus.crc_error_count;
 }
 
 uint16_t mw_get_i2c_drop_rate() {
 	//this get count of errors on MW->MW_SERVICE link only
-	struct S_MSP_LOCALSTATUS lstatus;
-	
-	shm_get_incoming(&mw_msg,MSP_LOCALSTATUS);
-	mspmsg_LOCALSTATUS_parse(&lstatus,&mw_msg);	
+	struct S_MSP_LOCALSTATUS *lstatus = &vehicle_state.lstatus;
 
-	if (!lstatus.rx_count) return 0;
-	return (lstatus.crc_error_count/lstatus.rx_count)*10000; //100%=10000
+	if (!lstatus->rx_count) return 0;
+	return (lstatus->crc_error_count/lstatus->rx_count)*10000; //100%=10000
 }
 
 char *mw_get_rc_tunning_name(uint8_t i) {
@@ -443,56 +1016,26 @@ char *mw_get_rc_tunning_name(uint8_t i) {
 }
 
 void mw_get_rc_tunning(uint8_t* v, uint8_t id) {
-	struct S_MSP_RC_TUNING rct;
-	
-	shm_get_incoming(&mw_msg,MSP_RC_TUNING);
-	mspmsg_RC_TUNING_parse(&rct,&mw_msg);
-
-	(*v) = ((uint8_t*)&rct)[id];
+	(*v) = ((uint8_t*)&vehicle_state.rc_tuning)[id];
 }
 
 void mw_set_rc_tunning(uint8_t* v, uint8_t id) {
-	struct S_MSP_RC_TUNING rct;
-	
-	shm_get_incoming(&mw_msg,MSP_RC_TUNING);
-	mspmsg_RC_TUNING_parse(&rct,&mw_msg);
-
-	((uint8_t*)&rct)[id] = (*v);
-	//save
-	mspmsg_SET_RC_TUNING_serialize(&mw_msg,&rct);
+	if (mw_write_reseed(WR_RC_TUNING)) wr_rc_tuning = vehicle_state.rc_tuning;
 
-	shm_put_outgoing(&mw_msg);
-
-	//refresh
-	mspmsg_RC_TUNING_serialize(&mw_msg);
-	shm_put_outgoing(&mw_msg);	
+	((uint8_t*)&wr_rc_tuning)[id] = (*v);
+	mw_write_queue(WR_RC_TUNING);
 }
 
 uint16_t mw_get_battery_voltage() {
-	struct S_MSP_ANALOG analog;
-	
-	shm_get_incoming(&mw_msg,MSP_ANALOG);
-	mspmsg_ANALOG_parse(&analog,&mw_msg);
-
-	return analog.vbat;
+	return vehicle_state.analog.vbat;
 }
 
 uint16_t mw_get_battery_amp() {
-	struct S_MSP_ANALOG analog;
-	
-	shm_get_incoming(&mw_msg,MSP_ANALOG);
-	mspmsg_ANALOG_parse(&analog,&mw_msg);
-
-	return analog.amperage;	
+	return vehicle_state.analog.amperage;	
 }
 
 void mw_get_rth_alt(uint16_t *alt) {
-	struct S_MSP_NAV_CONFIG nav;
-	
-	shm_get_incoming(&mw_msg,MSP_NAV_CONFIG);
-	mspmsg_NAV_CONFIG_parse(&nav,&mw_msg);
-
-	(*alt) = nav.rth_altitude;
+	(*alt) = vehicle_state.nav.rth_altitude;
 	printf("RTH %u\n",*alt);
 }
 
@@ -505,49 +1048,26 @@ void mw_set_failsafe_timeout(uint8_t v) {
 }
 
 void mw_set_rth_alt(uint16_t *alt) {
-	struct S_MSP_NAV_CONFIG nav;
-	
-	shm_get_incoming(&mw_msg,MSP_NAV_CONFIG);
-	mspmsg_NAV_CONFIG_parse(&nav,&mw_msg);
-
-	nav.rth_altitude = (*alt);
-	//save
-	mspmsg_NAV_CONFIG_SET_serialize(&mw_msg,&nav);
+	if (mw_write_reseed(WR_NAV_CONFIG)) wr_nav = vehicle_state.nav;
 
-	shm_put_outgoing(&mw_msg);
-
-	//refresh
-	mspmsg_NAV_CONFIG_serialize(&mw_msg);
-	shm_put_outgoing(&mw_msg);
+	wr_nav.rth_altitude = (*alt);
+	mw_write_queue(WR_NAV_CONFIG);
 }
 
 void mw_get_failsafe_throttle(uint16_t* throttle) {
-	struct S_MSP_MISC misc;
-	
-	shm_get_incoming(&mw_msg,MSP_MISC);
-	mspmsg_MISC_parse(&misc,&mw_msg);
-
-	(*throttle) = misc.failsafe_throttle;
+	(*throttle) = vehicle_state.misc.failsafe_throttle;
 }
 
 void mw_set_failsafe_throttle(uint16_t* throttle) {
-	struct S_MSP_MISC misc;
-	
-	shm_get_incoming(&mw_msg,MSP_MISC);
-	mspmsg_MISC_parse(&misc,&mw_msg);
-
-	misc.failsafe_throttle = (*throttle);
-	//save
-	mspmsg_SET_MISC_serialize(&mw_msg,&misc);
-
-	shm_put_outgoing(&mw_msg);
+	if (mw_write_reseed(WR_MISC)) wr_misc = vehicle_state.misc;
 
-	//refresh
-	mspmsg_MISC_serialize(&mw_msg);
-	shm_put_outgoing(&mw_msg);	
+	wr_misc.failsafe_throttle = (*throttle);
+	mw_write_queue(WR_MISC);
 }
 
-void mw_manual_control(int16_t throttle, int16_t yaw, int16_t pitch, int16_t roll) {
+void mw_manual_control(int16_t throttle, int16_t yaw, int16_t pitch, int16_t roll, uint64_t rx_time) {
+	uint64_t elapsed;
+
 	if (suppress_rc) return;
 	rc.throttle = throttle;
 	rc.yaw = yaw;
@@ -555,49 +1075,38 @@ void mw_manual_control(int16_t throttle, int16_t yaw, int16_t pitch, int16_t rol
 	rc.pitch = pitch;
 
 	rc_count = RC_TIMEOUT; 
-}
+	rc_stamp = rx_time;
 
+	if (!rc_spacing) return; //goes out with the next mw_feed_rc
 
-void mw_attitude_quaternions(float *w, float *x, float *y, float *z) {
-	struct S_MSP_ATTITUDE attitude;
-	
-	shm_get_incoming(&mw_msg,MSP_ATTITUDE);
-	mspmsg_ATTITUDE_parse(&attitude,&mw_msg);
+	elapsed = event_now_us()-rc_sent;
+	if (elapsed>=(uint64_t)rc_spacing*1000) {
+		rc_direct++;
+		rc_send();
+	} else if (!sched_get_period(rc_held_task)) { //too soon, the newest input goes out once the spacing has elapsed
+		sched_set_period(rc_held_task, rc_spacing-elapsed/1000);
+	}
+}
 
-	//printf("yaw: %i x: %i y: %i\n",attitude.heading,attitude.angx/10,attitude.angy/10);
 
-	float a = (M_PI / 180) * attitude.angx/10.f;
-	float b = (M_PI / 180) * attitude.heading;
-	float c = -(M_PI / 180) * attitude.angy/10.f;
+void mw_attitude_quaternions(float *w, float *x, float *y, float *z) {
+	float *q = vehicle_state.q;
 
-    double c1 = cos(a/2);
-    double s1 = sin(a/2);
-    double c2 = cos(b/2);
-    double s2 = sin(b/2);
-    double c3 = cos(c/2);
-    double s3 = sin(c/2);
-    double c1c2 = c1*c2;
-    double s1s2 = s1*s2;
-    if (w) (*w) = c1c2*c3 - s1s2*s3;
-  	if (x) (*x) = c1c2*s3 + s1s2*c3;
-	if (y) (*y) = s1*c2*c3 + c1*s2*s3;
-	if (z) (*z) = c1*s2*c3 - s1*c2*s3;
+	if (w) (*w) = q[0];
+	if (x) (*x) = q[1];
+	if (y) (*y) = q[2];
+	if (z) (*z) = q[3];
 }
 
 void mw_altitude(int32_t *alt) {
-	struct S_MSP_ALTITUDE altitude;
-	
-	shm_get_incoming(&mw_msg,MSP_ALTITUDE);
-	mspmsg_ALTITUDE_parse(&altitude,&mw_msg);
-
-	if (alt) (*alt) = altitude.EstAlt;	
+	if (alt) (*alt) = vehicle_state.altitude.EstAlt;	
 }
 
 
 void mw_raw_gps(uint8_t *fix, int32_t *lat, int32_t *lon, int32_t *alt, uint16_t *vel, uint16_t *cog, uint8_t *satellites_visible) {
-	struct S_MSP_RAW_GPS gps;
+	struct S_MSP_RAW_GPS *gps = &vehicle_state.gps;
 	
-	if (!msp_has_gps(&status)) {
+	if (!msp_has_gps(&vehicle_state.status)) {
 		if (fix) (*fix) = 0;
 		if (lat) (*lat) = 0;
 		if (lon) (*lon) = 0;
@@ -608,16 +1117,13 @@ void mw_raw_gps(uint8_t *fix, int32_t *lat, int32_t *lon, int32_t *alt, uint16_t
 		return;
 	}
 
-	shm_get_incoming(&mw_msg,MSP_RAW_GPS);
-	mspmsg_RAW_GPS_parse(&gps,&mw_msg);	
-
-	if (fix) (*fix) = gps.fix?3:0;
-	if (lat) (*lat) = gps.lat;
-	if (lon) (*lon) = gps.lon;
-	if (alt) (*alt) = gps.alt;
-	if (vel) (*vel) = gps.speed;
-	if (cog) (*cog) = gps.ground_course*10;
-	if (satellites_visible) (*satellites_visible) = gps.num_sat;
+	if (fix) (*fix) = gps->fix?3:0;
+	if (lat) (*lat) = gps->lat;
+	if (lon) (*lon) = gps->lon;
+	if (alt) (*alt) = gps->alt;
+	if (vel) (*vel) = gps->speed;
+	if (cog) (*cog) = gps->ground_course*10;
+	if (satellites_visible) (*satellites_visible) = gps->num_sat;
 }
 
 void mw_get_homepos(int32_t *lat, int32_t *lon, int32_t *alt) {
@@ -692,74 +1198,42 @@ uint8_t mw_get_pid_id(const char *name) {
 }
 
 void mw_get_pid_value(uint8_t *ret, uint8_t id) { //this should be only called once mav_param_refresh returns 1 to ensure it is up to date
-	struct S_MSP_PIDITEMS pids;
-	shm_get_incoming(&mw_msg,MSP_PID);
-	mspmsg_PID_parse(&pids,&mw_msg);	
+	struct S_MSP_PIDITEMS *pids = &vehicle_state.pid;
 
 	switch (id%3) {
-		case 0: (*ret)=pids.pid[id/3].P8; break;
-		case 1: (*ret)=pids.pid[id/3].I8; break;
-		case 2: (*ret)=pids.pid[id/3].D8; break;
+		case 0: (*ret)=pids->pid[id/3].P8; break;
+		case 1: (*ret)=pids->pid[id/3].I8; break;
+		case 2: (*ret)=pids->pid[id/3].D8; break;
 	}
 }
 
 void mw_set_pid(uint8_t *v, uint8_t id) {
-	struct S_MSP_PIDITEMS pids;
-
-	//get current value of pids
-	shm_get_incoming(&mw_msg,MSP_PID);
-	mspmsg_PID_parse(&pids,&mw_msg);
+	//changes build on the copy of the block while the board has not reported the last batch, see mw_write_reseed
+	if (mw_write_reseed(WR_PID)) wr_pid = vehicle_state.pid;
 
-	//write new param
 	switch (id%3) {
-		case 0: pids.pid[id/3].P8 = (*v); break;
-		case 1: pids.pid[id/3].I8 = (*v); break;
-		case 2: pids.pid[id/3].D8 = (*v); break;
+		case 0: wr_pid.pid[id/3].P8 = (*v); break;
+		case 1: wr_pid.pid[id/3].I8 = (*v); break;
+		case 2: wr_pid.pid[id/3].D8 = (*v); break;
 	}
 
-	//send it to the service
-	mspmsg_SET_PID_serialize(&mw_msg,&pids);
-	shm_put_outgoing(&mw_msg);
-
-	mw_pid_refresh(1);
+	mw_write_queue(WR_PID);
 }
 
 void mw_get_signal(int8_t *rssi, int8_t *noise) {
-	struct S_MSP_LOCALSTATUS t;
-	
-	shm_get_incoming(&mw_msg,MSP_LOCALSTATUS);
-	mspmsg_LOCALSTATUS_parse(&t,&mw_msg);	
-
-	if (rssi) (*rssi) = t.rssi;
-	if (noise) (*noise) = t.noise;	
+	if (rssi) (*rssi) = vehicle_state.lstatus.rssi;
+	if (noise) (*noise) = vehicle_state.lstatus.noise;	
 }
 
 uint32_t mw_sys_status_sensors() {
-	//we take it from status message
-	uint32_t ret = 0;
-//	struct S_MSP_BOXCONFIG boxconfig;
-
-/*
-	shm_get_incoming(&mw_msg,MSP_BOXIDS);
-	mspmsg_BOXIDS_parse(&boxconfig,&mw_msg);
-*/
-
-	ret = MAV_SYS_STATUS_SENSOR_3D_GYRO; //assume we always have gyro
-
-	ret |= MAV_SYS_STATUS_SENSOR_YAW_POSITION; 
-
-	if (get_bit(status.sensor,0)) ret |= (MAV_SYS_STATUS_SENSOR_3D_ACCEL | MAV_SYS_STATUS_SENSOR_ATTITUDE_STABILIZATION);	//acc
-	if (get_bit(status.sensor,1)) ret |= MAV_SYS_STATUS_SENSOR_Z_ALTITUDE_CONTROL;	//baro
-	if (get_bit(status.sensor,2)) ret |= MAV_SYS_STATUS_SENSOR_3D_MAG;	//mag
-	if (get_bit(status.sensor,3)) ret |= MAV_SYS_STATUS_SENSOR_GPS; 	//gps
-	if (get_bit(status.sensor,4)) ret |= MAV_SYS_STATUS_SENSOR_Z_ALTITUDE_CONTROL;	//sonar
-
-	return ret;
+	return vehicle_state.sensors;
 }
 
 uint8_t mw_state() {
 	if (failsafe) return MAV_STATE_EMERGENCY;
 
+	if (!mw_ready()) return MAV_STATE_BOOT; //still loading the board configuration
+
 	switch (mw_status) {
 		case 0: return MAV_STATE_STANDBY;
 		case 1: return MAV_STATE_ACTIVE;
@@ -771,68 +1245,29 @@ uint8_t mw_state() {
 
 uint8_t mw_mode_flag() {
 	uint8_t ret = 0;
-	if (msp_is_armed(&status)) ret |= (MAV_MODE_FLAG_SAFETY_ARMED | MAV_MODE_FLAG_MANUAL_INPUT_ENABLED);
-	if (msp_is_boxactive(&status,&boxconf,BOXBARO) || msp_is_boxactive(&status,&boxconf,BOXHORIZON)) ret |= MAV_MODE_FLAG_STABILIZE_ENABLED;
-	if (msp_is_boxactive(&status,&boxconf,BOXGPSHOME)) ret |= MAV_MODE_FLAG_AUTO_ENABLED | MAV_MODE_FLAG_GUIDED_ENABLED;
-	if (msp_is_boxactive(&status,&boxconf,BOXGPSNAV)) ret |= MAV_MODE_FLAG_AUTO_ENABLED | MAV_MODE_FLAG_GUIDED_ENABLED;
+	if (msp_is_armed(&vehicle_state.status)) ret |= (MAV_MODE_FLAG_SAFETY_ARMED | MAV_MODE_FLAG_MANUAL_INPUT_ENABLED);
+	if (msp_is_boxactive(&vehicle_state.status,&boxconf,BOXBARO) || msp_is_boxactive(&vehicle_state.status,&boxconf,BOXHORIZON)) ret |= MAV_MODE_FLAG_STABILIZE_ENABLED;
+	if (msp_is_boxactive(&vehicle_state.status,&boxconf,BOXGPSHOME)) ret |= MAV_MODE_FLAG_AUTO_ENABLED | MAV_MODE_FLAG_GUIDED_ENABLED;
+	if (msp_is_boxactive(&vehicle_state.status,&boxconf,BOXGPSNAV)) ret |= MAV_MODE_FLAG_AUTO_ENABLED | MAV_MODE_FLAG_GUIDED_ENABLED;
 	
 	return ret;
 }
 
 uint8_t mw_type() {
-	struct S_MSP_IDENT ident;
-
-	shm_get_incoming(&mw_msg,MSP_IDENT);
-	mspmsg_IDENT_parse(&ident,&mw_msg);
-
-	switch (ident.multitype) {
-
-		case MULTITYPETRI: return MAV_TYPE_TRICOPTER;
-
-		case MULTITYPEVTAIL4: return MAV_TYPE_VTOL_QUADROTOR;
-
-		case MULTITYPEY4:
-		case MULTITYPEQUADP: 
-		case MULTITYPEQUADX: return MAV_TYPE_QUADROTOR;
-
-		case MULTITYPEY6:
-		case MULTITYPEHEX6:
-		case MULTITYPEHEX6H:
-		case MULTITYPEHEX6X: return MAV_TYPE_HEXAROTOR;
-
-		case MULTITYPEOCTOFLATP:
-		case MULTITYPEOCTOFLATX:
-		case MULTITYPEOCTOX8: return MAV_TYPE_OCTOROTOR;
-
-		case MULTITYPEGIMBAL: return MAV_TYPE_GIMBAL;
-
-		case MULTITYPEAIRPLANE:
-		case MULTITYPEFLYING_WING: return MAV_TYPE_FIXED_WING;
-
-		case MULTITYPEHELI_120_CCPM:
-		case MULTITYPEHELI_90_DEG: return MAV_TYPE_HELICOPTER;
-
-		case MULTITYPEBI:
-		case MULTITYPEDUALCOPTER: return MAV_TYPE_VTOL_DUOROTOR;
-
-		case MULTITYPESINGLECOPTER:
-		case MULTITYPENONE0:		
-		case MULTITYPENONE19:
-		default: return MAV_TYPE_GENERIC;	
-	}
+	return vehicle_state.mav_type;
 }
 
 uint8_t is_mode_rth() {
-	if (msp_is_boxactive(&status,&boxconf,BOXHORIZON)==0) return 0;
+	if (msp_is_boxactive(&vehicle_state.status,&boxconf,BOXHORIZON)==0) return 0;
 
-	if (msp_is_boxactive(&status,&boxconf,BOXGPSHOME)==0) return 0;
+	if (msp_is_boxactive(&vehicle_state.status,&boxconf,BOXGPSHOME)==0) return 0;
 
 	return 1;
 }
 
 uint8_t is_mode_baro() {
 
-	if (msp_is_boxactive(&status,&boxconf,BOXBARO)==0) return 0;	
+	if (msp_is_boxactive(&vehicle_state.status,&boxconf,BOXBARO)==0) return 0;	
 
 	return 1;
 }
@@ -11,16 +11,30 @@
 #include <mw/msp.h>
 #include <mw/shm.h>
 
-void mw_loop();
-uint8_t mw_init();
+uint8_t mw_init(); //does not block, the board configuration is loaded in the background
 void mw_end();
 
+uint8_t mw_ready(); //1 once the board configuration has been loaded (or the handshake deadline has passed)
+void mw_set_handshake_deadline(uint16_t ms);
+
+uint32_t mw_state_gen(uint8_t msp_id); //changes whenever a new response for msp_id has been decoded
+
+//demand driven polling: every consumer of a MSP message declares how often it reads it
+uint8_t mw_demand_add(uint8_t msp_id); //returns a handle, UINT8_MAX if msp_id is not polled on demand
+uint16_t mw_demand_set(uint8_t handle, uint16_t period_ms); //0 - not consuming; returns the fastest period the source is polled at
+void mw_print_stats();
+
 void mw_arm();
 void mw_disarm();
 
 void mw_eeprom_write(uint8_t *dummy); //dummy for compatibilty
+void mw_set_write_commit(uint8_t commit); //1 - every batch of board writes ends with EEPROM_WRITE
+
+void mw_manual_control(int16_t throttle, int16_t yaw, int16_t pitch, int16_t roll, uint64_t rx_time);
+void mw_set_rc_cut_through(uint16_t spacing_ms); //0 - rc goes out with the periodic feed only
 
-void mw_manual_control(int16_t throttle, int16_t yaw, int16_t pitch, int16_t roll);
+typedef void (*t_rc_shaper)(uint64_t now, struct S_MSP_RC *rc);
+void mw_set_rc_shaper(t_rc_shaper cb); //cb may adjust the sticks every time rc is sent to the board
 
 void mw_altitude(int32_t *alt);
 void mw_attitude_quaternions(float *w, float *x, float *y, float *z);
@@ -9,14 +9,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "def.h"
 #include "global.h"
 #include "gamepad.h"
+#include "sched.h"
+#include "rx.h"
+#include "event.h"
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #ifdef CFG_ENABLED
-	#include <sys/stat.h> 
-	#include <fcntl.h>
 	config_t cfg;
 #endif
 
@@ -38,38 +45,191 @@ struct s_param {
 	uint8_t idx; //used only for get and set with idx
 	t_param_get get_value;
 	t_param_set set_value;	
-	uint8_t delayed; //delayed parameter - when setting it, the get should be performed with a delay
+	uint8_t msp; //board params: MSP block the value lives in, a write is only confirmed once the board answers; 0 - local
 	uint8_t can_save;
 };
 
 static struct s_param *param;
 
+/*
+	registry, built once by params_index_build
+	params of a component are added at one go, so every component is a dense slice of param indexed by id
+	names are found through an open addressing hash (linear probing) keyed by component and name
+*/
+#define PARAM_HASH_SIZE 512 //power of 2, at least twice the number of params
+
+static struct s_param *component_first[PARAM_COMPONENT_COUNT];
+static uint8_t component_count[PARAM_COMPONENT_COUNT];
+static uint16_t name_hash[PARAM_HASH_SIZE]; //index into param + 1, 0 - empty
+
+static uint16_t list_task = SCHED_NONE; //runs params_get_all while a param list is being sent
+
+/*
+	param list transfer: the list is streamed at list_rate instead of in a single burst
+	params the GCS re-requests while the transfer runs are gaps, they go out before the stream continues
+	the transfer lingers for PARAM_LIST_LINGER_MS after the last param so the GCS retries are handled as gaps too
+	once the GCS had to re-request more than 1 in PARAM_LOSSY params, every gap is sent twice (a pass over
+	all gaps, then a second one) so a lost retransmission does not cost another GCS timeout
+*/
+#define PARAM_LIST_RATE 200 //params/s
+#define PARAM_LIST_LINGER_MS 3000
+#define PARAM_LOSSY 20
+
+static uint16_t list_rate = PARAM_LIST_RATE;
+static uint8_t list_active = 0;
+static uint16_t list_pos = 0; //next param of the stream, index into param
+static uint32_t list_credit = 0; //1/1000 of a param
+static uint8_t gap[256]; //copies of each param (index into param) still to be resent
+static uint16_t gap_count = 0; //sum of gap
+static uint8_t gap_scan = 0; //gaps are served round robin
+static uint16_t list_requested = 0; //PARAM_REQUEST_READ received during the transfer
+static uint16_t list_resent = 0;
+static uint64_t list_start = 0; //us
+static uint64_t list_last = 0; //us, last param sent
+
+static uint32_t names_gen = 0; //MSP_BOXIDS generation the button names were built from
+
+/*
+	param set hash, published as the _HASH_CHECK pseudo param (uint32) of the first component ahead of every param list
+	a GCS holding a list with the same hash answers with a PARAM_SET of _HASH_CHECK and skips the download of that component
+	the hash is the one QGroundControl computes over its cache: a CRC32 (reflected 0xEDB88320, starting at 0, no final xor)
+	running over the name and the value bytes (as many as the type has) of each param of the component, in name order
+	the CRC is only recomputed when a value of the component has changed; board params are compared again whenever one
+	of the MSP blocks behind them has been refreshed
+*/
+#define PARAM_HASH_CHECK "_HASH_CHECK"
+#define PARAM_HASH_MSP_COUNT 4
+
+static uint32_t hash_value[256]; //index into param, value the hash was computed with
+static uint32_t hash_all = 0;
+static uint8_t hash_dirty = 1;
+static uint32_t hash_crc[256];
+static const uint8_t hash_msp[PARAM_HASH_MSP_COUNT] = {MSP_PID, MSP_RC_TUNING, MSP_MISC, MSP_NAV_CONFIG};
+static uint32_t hash_gen[PARAM_HASH_MSP_COUNT];
+static uint8_t hash_ready = 0; //mw_ready() the board params were hashed with
+
+/*
+	writes of board params are pending until the board confirms them: once a response of the MSP block newer
+	than the write carries the new value, or after PARAM_WRITE_TIMEOUT_MS, PARAM_VALUE goes out with what the
+	board has; the GCS gets its ack without having to repeat PARAM_SET
+	several writes can be pending at once, a PARAM_SET repeating a pending write is not written again
+*/
+#define PARAM_WRITE_MAX 64 //a GCS may upload a whole tuning at once
+#define PARAM_WRITE_TIMEOUT_MS 750 //below the retry timeout of the GCS
+
+struct _S_PARAM_WRITE {
+	uint8_t active;
+	uint8_t i; //index into param
+	mavlink_param_union_t value;
+	uint32_t gen; //mw_state_gen of the block when the write was sent
+	uint64_t start; //us
+};
+typedef struct _S_PARAM_WRITE S_PARAM_WRITE;
+
+static S_PARAM_WRITE write_q[PARAM_WRITE_MAX];
+static uint16_t write_task = SCHED_NONE; //runs while writes are pending
+static uint32_t write_confirmed = 0;
+static uint32_t write_timeout = 0;
+static S_LATENCY write_latency; //write - confirmation
+
+/*
+	push on change: params change outside the GCS too (gamepad buttons, failsafe, the board itself)
+	every PARAM_DIFF_MS the params a GCS has been sent are compared with the value it was sent last,
+	each one that differs goes out as a single PARAM_VALUE so every GCS stays in sync without polling
+*/
+#define PARAM_DIFF_MS 250
+
+static uint8_t sent[256]; //index into param, 1 once the param has been sent
+static uint32_t sent_value[256]; //mavlink_param_union_t bytes as last sent
+static uint32_t pushed = 0;
+
 uint8_t params_count();
-void params_cfg_save();
+uint8_t params_count_component(uint8_t component);
+void params_store_save();
+void params_list_task();
+void params_write_task();
+void params_diff_task();
+void msg_param_request_list(mavlink_message_t *msg);
+void msg_param_request_read(mavlink_message_t *msg);
+void msg_param_set(mavlink_message_t *msg);
+static void list_gap_set(uint8_t i, uint8_t copies);
+static void params_hash_build();
+
+static uint32_t _fnv(uint32_t h, const uint8_t *b, uint8_t len) { //FNV-1a
+	while (len--) {
+		h ^= *b++;
+		h *= 16777619u;
+	}
 
-static struct s_param *_get_param(uint8_t component, uint8_t id) {
-	uint8_t i;
+	return h;
+}
+
+static uint16_t _name_hash(uint8_t component, const char *name) {
+	return _fnv(2166136261u ^ component,(const uint8_t*)name,strlen(name)) & (PARAM_HASH_SIZE-1);
+}
+
+//has to be called whenever param names change
+static void params_index_build() {
+	uint8_t i, c;
 	uint8_t p_count = params_count();
+	uint16_t h;
+
+	memset(component_first,0,sizeof(component_first));
+	memset(component_count,0,sizeof(component_count));
+	memset(name_hash,0,sizeof(name_hash));
+
+	if (!param) return;
+
+	for (i=0;i<p_count;i++) {
+		c = param[i].component-PARAM_COMPONENT_FIRST;
+		if (c<PARAM_COMPONENT_COUNT) {
+			if (!component_count[c]) component_first[c] = &param[i];
+			component_count[c]++;
+		}
+
+		h = _name_hash(param[i].component,param[i].name);
+		while (name_hash[h]) h = (h+1) & (PARAM_HASH_SIZE-1);
+		name_hash[h] = i+1;
+	}
+}
+
+static struct s_param *_get_param(uint8_t component, uint8_t id) {
+	uint8_t c = component-PARAM_COMPONENT_FIRST;
+
+	if (!param || c>=PARAM_COMPONENT_COUNT || id>=component_count[c]) return NULL;
+
+	return &component_first[c][id];
+}
+
+static struct s_param *_get_param_by_name(uint8_t component, char *name) {
+	uint16_t h = _name_hash(component,name);
+	struct s_param *p;
 
 	if (!param) return NULL;
 
-	for (i=0;i<p_count;i++)
-		if ((param[i].component==component) && (param[i].id==id)) return &param[i];
+	while (name_hash[h]) {
+		p = &param[name_hash[h]-1];
+		if (p->component==component && strcmp(p->name,name)==0) return p;
+		h = (h+1) & (PARAM_HASH_SIZE-1);
+	}
 
 	return NULL;
 }
 
-static struct s_param *_get_param_by_name(uint8_t component, char *name) {
+//gamepad button names depend on the boxes the board supports, rebuild them once the box ids arrive
+static void params_names_refresh() {
 	uint8_t i;
 	uint8_t p_count = params_count();
 
-	if (!param) return NULL;
+	if (!param || names_gen==mw_state_gen(MSP_BOXIDS)) return;
+	names_gen = mw_state_gen(MSP_BOXIDS);
 
 	for (i=0;i<p_count;i++)
-		if (param[i].component==component)
-			if (strcmp(param[i].name,name)==0) return &param[i];
+		if (param[i].get_value==(t_param_get)gamepad_get_mapping)
+			sprintf(param[i].name,"%s",gamepad_get_button_name(param[i].idx));
 
-	return NULL;
+	params_index_build();
+	params_hash_build();
 }
 
 static mavlink_param_union_t *_get_value(uint8_t component, uint8_t id) {
@@ -99,6 +259,122 @@ static void _set_value(uint8_t component, uint8_t id, mavlink_param_union_t *v)
 	else p->set_value(v->bytes);
 }
 
+static uint8_t _param_size(uint8_t type) {
+	switch (type) {
+		case MAV_PARAM_TYPE_UINT8:
+		case MAV_PARAM_TYPE_INT8: return 1;
+		case MAV_PARAM_TYPE_UINT16:
+		case MAV_PARAM_TYPE_INT16: return 2;
+	}
+	return 4;
+}
+
+static uint32_t _crc32(uint32_t crc, const uint8_t *b, uint8_t len) {
+	uint8_t i;
+
+	for (i=0;i<len;i++) crc = hash_crc[(crc ^ b[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+//returns 1 if the value of the param changed since it was hashed
+static uint8_t params_hash_update(uint8_t i) {
+	mavlink_param_union_t *v = _get_value(param[i].component,param[i].id);
+	uint32_t value = 0;
+
+	if (v) memcpy(&value,v->bytes,_param_size(param[i].type));
+	if (value==hash_value[i]) return 0;
+
+	hash_value[i] = value;
+	if (param[i].component==PARAM_COMPONENT_FIRST) hash_dirty = 1;
+	return 1;
+}
+
+//CRC over the params of the first component in name order, as QGroundControl does
+static uint32_t params_hash() {
+	uint8_t order[256];
+	uint8_t i, j, n = 0, t;
+	uint8_t p_count = params_count();
+
+	if (!hash_dirty) return hash_all;
+
+	for (i=0;i<p_count;i++) { //insertion sort by name
+		if (param[i].component!=PARAM_COMPONENT_FIRST) continue;
+		for (j=n++;j && strcmp(param[order[j-1]].name,param[i].name)>0;j--) order[j] = order[j-1];
+		order[j] = i;
+	}
+
+	hash_all = 0;
+	for (j=0;j<n;j++) {
+		t = order[j];
+		hash_all = _crc32(hash_all,(const uint8_t*)param[t].name,strlen(param[t].name));
+		hash_all = _crc32(hash_all,(const uint8_t*)&hash_value[t],_param_size(param[t].type));
+	}
+	hash_dirty = 0;
+	return hash_all;
+}
+
+static void params_hash_build() {
+	uint32_t c;
+	uint16_t i;
+	uint8_t j;
+	uint8_t p_count = params_count();
+
+	if (!hash_crc[1])
+		for (i=0;i<256;i++) {
+			c = i;
+			for (j=0;j<8;j++) c = (c & 1)?0xEDB88320u ^ (c >> 1):c >> 1;
+			hash_crc[i] = c;
+		}
+
+	hash_all = 0;
+	hash_dirty = 1;
+	memset(hash_value,0,sizeof(hash_value));
+
+	if (!param) return;
+
+	for (i=0;i<PARAM_HASH_MSP_COUNT;i++) hash_gen[i] = mw_state_gen(hash_msp[i]);
+	hash_ready = mw_ready();
+
+	for (i=0;i<p_count;i++) params_hash_update(i);
+}
+
+//re-hashes board params once the board has sent new values; the ones already sent in a running transfer go out again
+static void params_hash_sync() {
+	uint8_t i, moved = 0;
+	uint8_t p_count = params_count();
+
+	if (!param) return;
+
+	for (i=0;i<PARAM_HASH_MSP_COUNT;i++)
+		if (hash_gen[i]!=mw_state_gen(hash_msp[i])) {
+			hash_gen[i] = mw_state_gen(hash_msp[i]);
+			moved = 1;
+		}
+	if (hash_ready!=mw_ready()) {
+		hash_ready = mw_ready();
+		moved = 1;
+	}
+	if (!moved) return;
+
+	for (i=0;i<p_count;i++)
+		if (param[i].msp && params_hash_update(i) && list_active && i<list_pos) list_gap_set(i,1);
+}
+
+static void params_send_hash() {
+	mavlink_param_union_t v;
+	uint8_t i;
+	uint8_t p_count = params_count();
+
+	params_hash_sync();
+	for (i=0;i<p_count && param;i++) params_hash_update(i); //values nobody has been sent since they changed
+	v.param_uint32 = param?params_hash():0;
+
+	mavlink_msg_param_value_pack(1,PARAM_COMPONENT_FIRST,&mav_msg,PARAM_HASH_CHECK,v.param_float,MAV_PARAM_TYPE_UINT32,params_count_component(PARAM_COMPONENT_FIRST),UINT16_MAX);
+	dispatch(&mav_msg);
+
+	printf("-> param_value %s: %08x\n",PARAM_HASH_CHECK,hash_all);
+}
+
 
 /* ============== RPI CAMERA HANDLING ========== */
 #ifdef RPICAM_ENABLED
@@ -169,7 +445,7 @@ void system_set(uint8_t* _value) {
 			ret = system(REBOOT_CMD);
 			break;
 		case 2: //save & sync;
-			params_cfg_save();
+			params_store_save();
 			ret = system("/bin/sync");
 			break;
 	}
@@ -210,6 +486,8 @@ uint8_t params_count() {
 		+ gamepad_button_count()
 		+ 1 //gamepad_mode
 		+ 3 //gamepad_threshold
+		+ 1 //gamepad_shape
+		+ 3 //gamepad_expo
 		+ 2 //failsafe
 		+ 1 //reboot
 		+ 7 //rc_tunning
@@ -225,19 +503,33 @@ uint8_t params_count() {
 }
 
 uint8_t params_count_component(uint8_t component) {
-	uint8_t i;
-	uint8_t ret = 0;
-	uint8_t all_count = params_count();
+	uint8_t c = component-PARAM_COMPONENT_FIRST;
 
-	for (i=0;i<all_count;i++)
-		if (param[i].component==component) ret++;
+	if (c>=PARAM_COMPONENT_COUNT) return 0;
+	return component_count[c];
+}
 
-	return ret;
+/*
+	params added after the libconfig layout, the "params" array of older versions has no element for them
+	the array holds the values of the other params that can be saved, in the order of the table
+*/
+static const char *cfg_added[] = {"!GAMEPAD_SHAPE","EXPO_YAW","EXPO_PITCH","EXPO_ROLL",NULL};
+
+static uint8_t _cfg_saved(uint8_t i) {
+	uint8_t j;
+
+	if (!param[i].can_save) return 0;
+	for (j=0;cfg_added[j];j++)
+		if (!strcmp(param[i].name,cfg_added[j])) return 0;
+	return 1;
 }
 
+//settings of older versions, imported once when there is no param store yet; the file is left as it is
 int params_cfg_load() {
 #ifdef CFG_ENABLED
 	uint8_t i,j;
+	if (access(CFG_FILE,F_OK)) return 0;
+
   	if(!config_read_file(&cfg, CFG_FILE))
   	{
   		printf("Unable to open.\n");
@@ -248,27 +540,24 @@ int params_cfg_load() {
   	}	
 
 //config initialization
-	config_setting_t *root = config_root_setting(&cfg);
 	config_setting_t *setting = config_lookup(&cfg,"params");
 	uint8_t count = 0;
 
 	for (i=0;i<params_count();i++) 
-		if (param[i].can_save) count++;
+		if (_cfg_saved(i)) count++;
 
 	if (setting) {
-		if (config_setting_length(setting)!=count) { //ensure the count of params has not changed, otherwise we invalidate the config
-			config_setting_remove(root,"params");
-			config_write_file(&cfg,CFG_FILE);
-			setting = NULL; 
-			printf("Params changed. Resetting.\n");
+		if (config_setting_length(setting)!=count) { //a layout we do not know (e.g. another count of gamepad buttons), keep the defaults
+			printf("Params of %s do not match (%d instead of %d), not imported.\n",CFG_FILE,config_setting_length(setting),count);
 		} else { //load them
 			j=0;
 			for (i=0;i<params_count();i++)
-				if (param[i].can_save) {
+				if (_cfg_saved(i)) {
 					mavlink_param_union_t v;
 					v.param_float = config_setting_get_float_elem(setting,j++);
 					_set_value(param[i].component,param[i].id, &v );
 				}
+			printf("Imported %d params of %s.\n",count,CFG_FILE);
 		}
 	}
 
@@ -278,54 +567,284 @@ int params_cfg_load() {
 	return 0;
 }
 
-void params_cfg_save() {
-#ifdef CFG_ENABLED
+/*
+	param store: values of the params that can be saved, in a binary file mapped into memory
+	a fixed header is followed by fixed size records keyed by component and name, so params can come and go
+	(e.g. gamepad buttons) without losing the settings of the others; records of params that are gone are kept
+	every record has two slots, the slots of all records A follow the header, then those of all records B;
+	a save writes the changed values into the older slot with the next sequence number and msyncs it, the load
+	takes the newest slot that passes its check, so a save torn by a power loss leaves the previous value in place
+	slots are 32 bytes and aligned, so none crosses a sector
+	when records have to be added the store is written to a new file, synced and renamed over the old one
+*/
+#define PARAM_STORE_MAGIC 0x534d4d4du //"MMMS"
+#define PARAM_STORE_VERSION 2
+
+struct _S_PARAM_STORE_HDR {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+	uint16_t count;
+	uint8_t reserved[18];
+	uint32_t check;
+};
+typedef struct _S_PARAM_STORE_HDR S_PARAM_STORE_HDR;
+
+struct _S_PARAM_STORE_REC {
+	char name[17]; //button names without the ~ of unsupported boxes
+	uint8_t component;
+	uint8_t type;
+	uint8_t seq; //the newer of the two slots wins, mod 256
+	uint8_t reserved[4];
+	uint32_t value; //mavlink_param_union_t bytes
+	uint32_t check;
+};
+typedef struct _S_PARAM_STORE_REC S_PARAM_STORE_REC;
+
+static S_PARAM_STORE_HDR *store = NULL; //mapped file, records follow the header
+static size_t store_size = 0;
+static uint16_t store_rec[256]; //record of each param (index into param), UINT16_MAX if it has none
+static uint8_t store_complete = 0; //every param that can be saved has a record
+
+static S_PARAM_STORE_REC *_store_slot(uint16_t r, uint8_t slot) {
+	return ((S_PARAM_STORE_REC*)(store+1))+(uint32_t)slot*store->count+r;
+}
+
+static uint32_t _store_rec_check(S_PARAM_STORE_REC *rec) {
+	return _fnv(2166136261u,(const uint8_t*)rec,offsetof(S_PARAM_STORE_REC,check));
+}
+
+//newest intact slot of the record, NULL if both are torn
+static S_PARAM_STORE_REC *_store_rec(uint16_t r) {
+	S_PARAM_STORE_REC *a = _store_slot(r,0);
+	S_PARAM_STORE_REC *b = _store_slot(r,1);
+	uint8_t a_ok = a->check==_store_rec_check(a);
+	uint8_t b_ok = b->check==_store_rec_check(b);
+
+	if (a_ok && b_ok) return ((int8_t)(b->seq-a->seq)>0)?b:a;
+	if (a_ok) return a;
+	if (b_ok) return b;
+	return NULL;
+}
+
+//the name of a record as a string, the mapping is not written to
+static void _store_rec_name(S_PARAM_STORE_REC *rec, char *name) {
+	memcpy(name,rec->name,16);
+	name[16] = 0;
+}
+
+static const char *_store_name(const char *name) {
+	return (name[0]=='~')?name+1:name;
+}
+
+//record still wanted in a new store: intact and of a param this build does not have
+static uint8_t _store_rec_orphan(uint16_t r) {
+	S_PARAM_STORE_REC *rec = _store_rec(r);
+	uint8_t p_count = params_count();
+	char name[17];
 	uint8_t i;
-	config_read_file(&cfg, CFG_FILE);
-	config_setting_t *root = config_root_setting(&cfg);
-	config_setting_t *ptr;
 
-	config_setting_t *setting = config_lookup(&cfg,"params");
+	if (!rec) return 0;
+	_store_rec_name(rec,name);
 
-	config_setting_remove(root,"params");
+	for (i=0;i<p_count;i++)
+		if (param[i].can_save && param[i].component==rec->component && strcmp(_store_name(param[i].name),name)==0) return 0;
 
-	setting = config_setting_add(root, "params", CONFIG_TYPE_ARRAY);
-	for (i=0;i<params_count();i++) 
+	return 1;
+}
+
+
+static void params_store_unmap() {
+	if (store) munmap(store,store_size);
+	store = NULL;
+	store_size = 0;
+	store_complete = 0;
+	memset(store_rec,0xff,sizeof(store_rec));
+}
+
+static uint8_t params_store_map() {
+	struct stat st;
+	int fd;
+
+	params_store_unmap();
+
+	fd = open(PARAM_STORE_FILE,O_RDWR);
+	if (fd<0) return 1;
+
+	if (fstat(fd,&st) || st.st_size<sizeof(S_PARAM_STORE_HDR)) {
+		close(fd);
+		return 1;
+	}
+
+	store = mmap(NULL,st.st_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd); //the mapping stays
+	if (store==MAP_FAILED) {
+		store = NULL;
+		return 1;
+	}
+	store_size = st.st_size;
+
+	if (store->magic!=PARAM_STORE_MAGIC || store->version!=PARAM_STORE_VERSION || store->rec_size!=sizeof(S_PARAM_STORE_REC)
+		|| store->check!=_fnv(2166136261u,(const uint8_t*)store,offsetof(S_PARAM_STORE_HDR,check))
+		|| store_size<sizeof(S_PARAM_STORE_HDR)+(size_t)store->count*2*sizeof(S_PARAM_STORE_REC)) {
+		printf("Param store invalid, ignoring.\n");
+		params_store_unmap();
+		return 1;
+	}
+
+	return 0;
+}
+
+//pairs params with their records, loads the values if apply is set
+static void params_store_match(uint8_t apply) {
+	uint8_t p_count = params_count();
+	uint16_t r, loaded = 0, saved = 0;
+	S_PARAM_STORE_REC *rec;
+	struct s_param *p;
+	char rec_name[17];
+	char name[18];
+	uint8_t i;
+
+	memset(store_rec,0xff,sizeof(store_rec));
+	if (!store || !param) return;
+
+	for (r=0;r<store->count;r++) {
+		rec = _store_rec(r);
+		if (!rec) continue;
+		_store_rec_name(rec,rec_name);
+
+		p = _get_param_by_name(rec->component,rec_name);
+		if (!p) { //an unsupported box
+			sprintf(name,"~%s",rec_name);
+			p = _get_param_by_name(rec->component,name);
+		}
+		if (!p || !p->can_save || p->type!=rec->type || store_rec[p-param]!=UINT16_MAX) continue;
+
+		store_rec[p-param] = r;
+		if (apply) _set_value(p->component,p->id,(mavlink_param_union_t*)&rec->value);
+		loaded++;
+	}
+
+	store_complete = 1;
+	for (i=0;i<p_count;i++)
 		if (param[i].can_save) {
-			ptr=config_setting_add(setting,NULL,CONFIG_TYPE_FLOAT);
-			mavlink_param_union_t *v = _get_value(param[i].component,param[i].id);
-			config_setting_set_float(ptr,v->param_float);
+			saved++;
+			if (store_rec[i]==UINT16_MAX) store_complete = 0;
 		}
 
- 	if (!config_write_file(&cfg,CFG_FILE)) 
- 		printf("Error while writing config file. Settings won't be stored.\n");
+	if (apply) printf("Param store: %u of %u params loaded\n",loaded,saved);
+}
 
- 	config_destroy(&cfg);
-#endif 	
+static uint8_t params_store_load() {
+	if (params_store_map()) return 1;
+
+	params_store_match(1);
+	return 0;
 }
 
-void params_cfg_open() {
-#ifdef CFG_ENABLED
-	int ret;
-//config file open
-	printf("Opening config: %s...\n",CFG_FILE);
-
-	if (access(CFG_FILE,F_OK)) {
-		printf("Not found. Creating...\n");
-		ret = creat(CFG_FILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-		if (ret>0) {
-			printf("Success.\n");
-			close(ret); //we need to close as config_read_file re-opens it
+//writes a new store with a record for every param that can be saved and renames it over the old one
+//the values go into the A slots, the B slots are left empty (they fail their check)
+static void params_store_write() {
+	uint8_t p_count = params_count();
+	S_PARAM_STORE_HDR hdr;
+	S_PARAM_STORE_REC rec;
+	mavlink_param_union_t *v;
+	uint16_t r;
+	uint8_t i, ok = 1;
+	FILE *f;
+	int fd;
+
+	memset(&hdr,0,sizeof(hdr));
+	hdr.magic = PARAM_STORE_MAGIC;
+	hdr.version = PARAM_STORE_VERSION;
+	hdr.rec_size = sizeof(S_PARAM_STORE_REC);
+
+	for (i=0;i<p_count;i++)
+		if (param[i].can_save) hdr.count++;
+	if (store)
+		for (r=0;r<store->count;r++)
+			if (_store_rec_orphan(r)) hdr.count++;
+	hdr.check = _fnv(2166136261u,(const uint8_t*)&hdr,offsetof(S_PARAM_STORE_HDR,check));
+
+	f = fopen(PARAM_STORE_FILE".tmp","wb");
+	if (!f) {
+		perror("param store");
+		return;
+	}
+
+	if (fwrite(&hdr,sizeof(hdr),1,f)!=1) ok = 0;
+
+	for (i=0;i<p_count && ok;i++)
+		if (param[i].can_save) {
+			memset(&rec,0,sizeof(rec));
+			strcpy(rec.name,_store_name(param[i].name));
+			rec.component = param[i].component;
+			rec.type = param[i].type;
+			v = _get_value(param[i].component,param[i].id);
+			if (v) memcpy(&rec.value,v->bytes,4);
+			rec.check = _store_rec_check(&rec);
+			if (fwrite(&rec,sizeof(rec),1,f)!=1) ok = 0;
 		}
+
+	//records of params this build does not have
+	if (store)
+		for (r=0;r<store->count && ok;r++)
+			if (_store_rec_orphan(r) && fwrite(_store_rec(r),sizeof(S_PARAM_STORE_REC),1,f)!=1) ok = 0;
+
+	memset(&rec,0,sizeof(rec));
+	for (r=0;r<hdr.count && ok;r++)
+		if (fwrite(&rec,sizeof(rec),1,f)!=1) ok = 0;
+
+	if (ok && (fflush(f) || fsync(fileno(f)))) ok = 0;
+	if (fclose(f) || !ok || rename(PARAM_STORE_FILE".tmp",PARAM_STORE_FILE)) {
+		printf("Error while writing param store. Settings won't be stored.\n");
+		unlink(PARAM_STORE_FILE".tmp");
+		return;
 	}
 
-#endif
+	fd = open(PARAM_STORE_DIR,O_RDONLY | O_DIRECTORY); //the rename is only durable once the directory is
+	if (fd<0 || fsync(fd)) perror("param store dir");
+	if (fd>=0) close(fd);
+
+	if (!params_store_map()) params_store_match(0);
 }
 
-void params_cfg_end() {
-#ifdef CFG_ENABLED
+void params_store_save() {
+	uint8_t p_count = params_count();
+	S_PARAM_STORE_REC *rec, *next;
+	mavlink_param_union_t *v;
+	uint8_t i, dirty = 0;
+	uint32_t value;
 
-#endif
+	if (!param) return;
+
+	if (!store || !store_complete) {
+		params_store_write();
+		return;
+	}
+
+	for (i=0;i<p_count;i++)
+		if (param[i].can_save) {
+			v = _get_value(param[i].component,param[i].id);
+			if (!v) continue;
+			memcpy(&value,v->bytes,4);
+
+			rec = _store_rec(store_rec[i]);
+			if (!rec) { //both slots torn since the store was matched
+				params_store_write();
+				return;
+			}
+			if (rec->value==value) continue;
+
+			next = _store_slot(store_rec[i],rec==_store_slot(store_rec[i],0));
+			memcpy(next,rec,sizeof(S_PARAM_STORE_REC));
+			next->seq = rec->seq+1;
+			next->value = value;
+			next->check = _store_rec_check(next);
+			dirty = 1;
+		}
+
+	if (dirty && msync(store,store_size,MS_SYNC)) perror("param store msync");
 }
 
 void params_init() {
@@ -346,7 +865,7 @@ void params_init() {
 		param[i].get_value = NULL;
 		param[i].set_value = NULL;
 		param[i].can_save = 0;
-		param[i].delayed = 0;
+		param[i].msp = 0;
 		param[i].type = MAV_PARAM_TYPE_UINT8;
 	}
 
@@ -368,7 +887,7 @@ void params_init() {
 		param[i+offset].idx = i; //used for the get and set functions
 		param[i+offset].get_value = (t_param_get)mw_get_pid_value;
 		param[i+offset].set_value = (t_param_set)mw_set_pid;
-		param[i+offset].delayed = 1;
+		param[i+offset].msp = MSP_PID;
 		param[i+offset].can_save = 0; //we dont want to save in CFG but in MW board
 	}
 	offset += i;
@@ -390,6 +909,13 @@ void params_init() {
 	param[offset].can_save = 1;
 	offset += 1;
 
+	param[offset].component = 201;
+	sprintf(param[offset].name,"%s","!GAMEPAD_SHAPE");
+	param[offset].get_value = (t_param_get)gamepad_get_shape;
+	param[offset].set_value = (t_param_set)gamepad_set_shape;
+	param[offset].can_save = 1;
+	offset += 1;
+
 
 	param[offset].component = 201;
 	sprintf(param[offset].name,"%s","!SYS");
@@ -423,7 +949,7 @@ void params_init() {
 	param[offset].get_value = (t_param_get)mw_get_failsafe_throttle;
 	param[offset].set_value = (t_param_set)mw_set_failsafe_throttle;
 	param[offset].type = MAV_PARAM_TYPE_UINT16;
-	param[offset].delayed = 1;
+	param[offset].msp = MSP_MISC;
 	offset += 1;
 
 	param[offset].idx = 0;
@@ -450,12 +976,36 @@ void params_init() {
 	param[offset].can_save = 1;
 	offset += 1;
 
+	param[offset].idx = 0;
+	param[offset].component = 202;
+	sprintf(param[offset].name,"%s","EXPO_YAW");
+	param[offset].get_value = (t_param_get)gamepad_get_expo;
+	param[offset].set_value = (t_param_set)gamepad_set_expo;
+	param[offset].can_save = 1;
+	offset += 1;
+
+	param[offset].idx = 1;
+	param[offset].component = 202;
+	sprintf(param[offset].name,"%s","EXPO_PITCH");
+	param[offset].get_value = (t_param_get)gamepad_get_expo;
+	param[offset].set_value = (t_param_set)gamepad_set_expo;
+	param[offset].can_save = 1;
+	offset += 1;
+
+	param[offset].idx = 2;
+	param[offset].component = 202;
+	sprintf(param[offset].name,"%s","EXPO_ROLL");
+	param[offset].get_value = (t_param_get)gamepad_get_expo;
+	param[offset].set_value = (t_param_set)gamepad_set_expo;
+	param[offset].can_save = 1;
+	offset += 1;
+
 	param[offset].component = 202;
 	sprintf(param[offset].name,"%s","RTH_ALT");
 	param[offset].get_value = (t_param_get)mw_get_rth_alt;
 	param[offset].set_value = (t_param_set)mw_set_rth_alt;
 	param[offset].type = MAV_PARAM_TYPE_UINT16;
-	param[offset].delayed = 1;
+	param[offset].msp = MSP_NAV_CONFIG;
 	offset += 1;
 
 	for (i=0;i<7;i++) {
@@ -464,7 +1014,7 @@ void params_init() {
 		param[offset+i].idx = i;
 		param[offset+i].get_value = (t_param_get)mw_get_rc_tunning;
 		param[offset+i].set_value = (t_param_set)mw_set_rc_tunning;
-		param[offset+i].delayed = 1;
+		param[offset+i].msp = MSP_RC_TUNING;
 	}
 	offset += i;
 
@@ -478,63 +1028,187 @@ void params_init() {
 		param[i].id=j++;
 	}
 
+	names_gen = mw_state_gen(MSP_BOXIDS);
+	params_index_build();
+
 	gamepad_init();
-	params_cfg_open();
-	params_cfg_load();
+	if (params_store_load()) { //first start, take over the settings of older versions
+		params_cfg_load();
+		params_store_save();
+	}
+	params_hash_build();
+
+	list_task = sched_add(params_list_task, 0, 0); //enabled on PARAM_REQUEST_LIST
+	write_task = sched_add(params_write_task, 0, 0); //enabled while board writes are pending
+	sched_add(params_diff_task, PARAM_DIFF_MS, 0);
+	memset(sent,0,sizeof(sent));
+	memset(write_q,0,sizeof(write_q));
+	latency_reset(&write_latency);
+
+	rx_register(MAVLINK_MSG_ID_PARAM_REQUEST_LIST, msg_param_request_list);
+	rx_register(MAVLINK_MSG_ID_PARAM_REQUEST_READ, msg_param_request_read);
+	rx_register(MAVLINK_MSG_ID_PARAM_SET, msg_param_set);
 }
 
 void params_end() {
-	params_cfg_save();
-	params_cfg_end();
+	params_store_save();
+	params_store_unmap();
 	if (param) free(param);
 	param = NULL;
+	params_index_build();
+	params_hash_build();
+}
+
+
+
+static void params_write_ack(S_PARAM_WRITE *w) {
+	w->active = 0;
+	params_send(param[w->i].component,param[w->i].id);
 }
 
+//sends a board param to the board, it is acked by params_write_task
+static void params_write(uint8_t i, mavlink_param_union_t *v) {
+	S_PARAM_WRITE *w = NULL;
+	uint8_t k;
+
+	for (k=0;k<PARAM_WRITE_MAX;k++)
+		if (write_q[k].active && write_q[k].i==i) {
+			if (!memcmp(write_q[k].value.bytes,v->bytes,_param_size(param[i].type))) return; //GCS retry, on its way
+			w = &write_q[k];
+			break;
+		}
+
+	for (k=0;k<PARAM_WRITE_MAX && !w;k++)
+		if (!write_q[k].active) w = &write_q[k];
+
+	if (!w) { //full, the oldest write is acked with whatever the board has now
+		w = &write_q[0];
+		for (k=1;k<PARAM_WRITE_MAX;k++)
+			if (write_q[k].start<w->start) w = &write_q[k];
+		params_write_ack(w);
+	}
+
+	w->active = 1;
+	w->i = i;
+	w->value = *v;
+	w->gen = mw_state_gen(param[i].msp);
+	w->start = event_now_us();
+
+	_set_value(param[i].component,param[i].id,v);
+	sched_set_period(write_task, LOOP_MS);
+}
 
+void params_write_task() {
+	uint64_t now = event_now_us();
+	mavlink_param_union_t *v;
+	S_PARAM_WRITE *w;
+	uint8_t k, pending = 0;
+
+	for (k=0;k<PARAM_WRITE_MAX;k++) {
+		w = &write_q[k];
+		if (!w->active) continue;
+
+		if (mw_state_gen(param[w->i].msp)!=w->gen) { //the board answered since the write
+			v = _get_value(param[w->i].component,param[w->i].id);
+			if (v && !memcmp(v->bytes,w->value.bytes,_param_size(param[w->i].type))) {
+				write_confirmed++;
+				latency_add(&write_latency,now-w->start);
+				params_write_ack(w);
+				continue;
+			}
+		}
+
+		if (now-w->start>=PARAM_WRITE_TIMEOUT_MS*1000) {
+			write_timeout++;
+			printf("Param %s not confirmed by the board\n",param[w->i].name);
+			params_write_ack(w);
+			continue;
+		}
+
+		pending = 1;
+	}
+
+	if (!pending) sched_set_period(write_task, 0);
+}
+
+static uint8_t _write_pending(uint8_t i) {
+	uint8_t k;
+
+	for (k=0;k<PARAM_WRITE_MAX;k++)
+		if (write_q[k].active && write_q[k].i==i) return 1;
+
+	return 0;
+}
+
+void params_diff_task() {
+	uint8_t p_count = params_count();
+	mavlink_param_union_t *v;
+	uint8_t i;
+
+	if (!param || !heartbeat) return; //no GCS, it gets the current values with the next list
+
+	for (i=0;i<p_count;i++) {
+		if (!sent[i] || (list_active && i>=list_pos)) continue; //the stream has not got there yet
+
+		v = _get_value(param[i].component,param[i].id);
+		if (!v || v->param_uint32==sent_value[i]) continue;
+		if (_write_pending(i)) continue; //acked by params_write_task
+
+		pushed++;
+		if (list_active) list_gap_set(i,1); //keeps to the pace of the transfer
+		else params_send(param[i].component,param[i].id);
+	}
+}
 
 void params_set(uint8_t component, char *name, float value) {
 	//sets the value of a param at idx
 	//send the param back
+	params_names_refresh();
 	struct s_param *p = _get_param_by_name(component,name);
 
-	//uint8_t old_val;
-
 	mavlink_param_union_t m_param;
-	mavlink_param_union_t* old;
 	m_param.param_float = value;
 
-	_set_value(p->component,p->id,&m_param);
+	if (!p) {
+		printf("Unknown param: %s component: %u\n",name,component);
+		return;
+	}
 
-	//for certain params it takes time to refresh them. We not gonna send back until it is set
-	
-	old = _get_value(p->component,p->id);
-	
-	if (old && p->delayed && p->delayed<4) { //try 4 times max
-		if (old->param_float != value) { //it got set correctly
-			p->delayed++;
-			return;
-		}
+	if (p->msp) { //sent back once the board has it
+		params_write(p-param,&m_param);
+		return;
 	}
-	if (p->delayed) p->delayed=1;
 
-	params_send(p->component,p->id);
+	_set_value(p->component,p->id,&m_param);
+	params_hash_update(p-param);
 
+	params_send(p->component,p->id);
 }
 
 void params_send(uint8_t component, uint8_t id) {
 	//reads value of a param at idx
 	//send is back
 
+	params_names_refresh();
 	struct s_param *p = _get_param(component,id);
 
 	mavlink_param_union_t m_param;
 	mavlink_param_union_t *ptr;
-	ptr = _get_value(component, id);
+
+	if (!p) {
+		printf("Unknown param id: %u component: %u\n",id,component);
+		return;
+	}
+
+	ptr = _get_value(p->component,p->id);
 	if (ptr) m_param = (*ptr);
 	else {
 		m_param.type = p->type;
 		m_param.param_float = 0.f;
 	}
+	params_hash_update(p-param); //keeps the hash in line with what the GCS has seen
+	sent[p-param] = 1;
+	sent_value[p-param] = m_param.param_uint32;
 
 	mavlink_msg_param_value_pack(1,p->component,&mav_msg,p->name,m_param.param_float, m_param.type,params_count_component(p->component),p->id);
 
@@ -544,26 +1218,92 @@ void params_send(uint8_t component, uint8_t id) {
 	printf("-> param_value id: %u component: %u, name: %s value: %i. ALL: %u\n",id,component,p->name,m_param.param_int32,params_count_component(p->component));
 }
 
+void params_set_list_rate(uint16_t rate) {
+	list_rate = rate?rate:PARAM_LIST_RATE;
+}
+
+static void list_gap_set(uint8_t i, uint8_t copies) {
+	if (gap[i]>=copies) return;
+	gap_count += copies-gap[i];
+	gap[i] = copies;
+}
+
+static void list_gap_add(uint8_t i) {
+	list_requested++;
+	list_gap_set(i,(list_requested*PARAM_LOSSY>list_pos)?2:1);
+}
+
+static uint8_t list_gap_take() {
+	while (!gap[gap_scan]) gap_scan++; //wraps, gap_count says there is one
+
+	gap[gap_scan]--;
+	gap_count--;
+	return gap_scan++;
+}
+
+//sends as many params as the rate allows for this tick, gaps first; returns 1 once everything has gone out
+static uint8_t list_stream() {
+	uint8_t p_count = params_count();
+	uint8_t i;
+
+	params_hash_sync();
+
+	list_credit += (uint32_t)list_rate*LOOP_MS; //runs every LOOP_MS
+	if (list_credit>(uint32_t)list_rate*LOOP_MS+1000) list_credit = (uint32_t)list_rate*LOOP_MS+1000; //no bursts after a stall
+
+	while (list_credit>=1000) {
+		if (gap_count) {
+			i = list_gap_take();
+			list_resent++;
+		} else if (list_pos<p_count) i = list_pos++;
+		else break;
+
+		params_send(param[i].component,param[i].id);
+		list_credit -= 1000;
+		list_last = event_now_us();
+	}
+
+	//values sent before the board answered are only final once the refresh is in
+	if (!mw_ready() || !mw_pid_refresh(0)) return 0;
+
+	return (list_pos>=p_count && !gap_count && event_now_us()-list_last>PARAM_LIST_LINGER_MS*1000);
+}
+
 //before we can send all values we need to refresh some of them
 uint8_t params_get_all(uint8_t reset) {
 	static uint8_t step = 0;
-	uint8_t i;
 
 	if (reset) {
 		if (debug) printf("Requesting pid_values...\n");
 		mw_pid_refresh(1);
 		step=0;
+
+		list_active = 1;
+		list_pos = 0;
+		list_credit = 0;
+		memset(gap,0,sizeof(gap));
+		gap_count = 0;
+		gap_scan = 0;
+		list_requested = 0;
+		list_resent = 0;
+		list_start = event_now_us();
+		list_last = list_start;
 	}
 
+	if (!param) return 1;
+
 	switch (step) {
-		case 0: //wait for params refresh to finish
+		case 0: //wait for the board configuration (or its cached copy, see mw.c), the refresh runs in the background
 			if (debug) printf("Waiting...\n");
-			if (mw_pid_refresh(0)) step++;
+			if (!mw_ready()) break;
+			params_send_hash();
+			step++;
 			break;
 		case 1: //send params
-			for (i=0;i<params_count();i++)
-				params_send(param[i].component,param[i].id);
-			
+			if (!list_stream()) break;
+
+			list_active = 0;
+			printf("Param list: %u params in %u ms, %u re-requested, %u resent\n",params_count(),(uint32_t)((list_last-list_start)/1000),list_requested,list_resent);
 			return 1;
 			break;
 	}
@@ -571,3 +1311,79 @@ uint8_t params_get_all(uint8_t reset) {
 	return 0;
 }
 
+//we keep calling params_get_all until all params are sent
+void params_list_task() {
+	if (params_get_all(0)) sched_set_period(list_task, 0);
+}
+
+void msg_param_request_list(mavlink_message_t *msg) {
+	if (params_get_all(1)) return;
+	sched_set_period(list_task, LOOP_MS);
+}
+
+void msg_param_request_read(mavlink_message_t *msg) {
+	int16_t idx;
+	uint8_t component;
+	char name[16+1];
+	struct s_param *p;
+
+	component = mavlink_msg_param_request_read_get_target_component(msg);
+	idx = mavlink_msg_param_request_read_get_param_index(msg);
+
+	if (idx<0) { //-1: look it up by name
+		mavlink_msg_param_request_read_get_param_id(msg,name);
+		name[16] = 0;
+		if (strcmp(name,PARAM_HASH_CHECK)==0) {
+			params_send_hash();
+			return;
+		}
+		params_names_refresh();
+		p = _get_param_by_name(component,name);
+		if (!p) {
+			printf("Unknown param: %s component: %u\n",name,component);
+			return;
+		}
+		idx = p->id;
+	}
+
+	if (list_active) { //part of a running transfer, goes out ahead of the stream
+		p = _get_param(component,idx);
+		if (p) {
+			list_gap_add(p-param);
+			return;
+		}
+	}
+
+	printf("Requesting param id: %i, component: %u\n",idx,component);
+	params_send(component,idx); //ids are per component, see params_index_build
+}
+
+void msg_param_set(mavlink_message_t *msg) {
+	//local params are acked right away, board params once the board confirms them (see params_write)
+
+	uint8_t component;
+	char name[16+1];
+	float value;
+
+	component = mavlink_msg_param_set_get_target_component(msg);
+	mavlink_msg_param_set_get_param_id(msg,name); //get name from the param
+	name[16] = 0; //not terminated when it is 16 chars long
+	value = mavlink_msg_param_set_get_param_value(msg);
+
+	printf("Set id: %s\n",name);
+
+	if (strcmp(name,PARAM_HASH_CHECK)==0) { //the GCS has the first component cached already, the others still go out
+		if (list_active && list_pos<params_count()) {
+			printf("Param list: cached by GCS (%08x) after %u params\n",hash_all,list_pos);
+			while (list_pos<params_count() && param[list_pos].component==PARAM_COMPONENT_FIRST) list_pos++; //whatever the board still changes goes out as gaps
+		}
+		return;
+	}
+
+	params_set(component,name,value);
+}
+
+void params_print_stats() {
+	printf("Param writes: confirmed=%u timeout=%u pushed=%u\n",write_confirmed,write_timeout,pushed);
+	latency_print("Param write confirmation",&write_latency);
+}
@@ -5,17 +5,22 @@
 #include "udp.h"
 #include "def.h"
 
+#define PARAM_COMPONENT_FIRST 200
+#define PARAM_COMPONENT_COUNT 3 //200 - board, 201 - gamepad and system, 202 - flight settings
 
 void params_init();
 
 void params_end();
 
 uint8_t params_get_all(uint8_t reset);
+void params_set_list_rate(uint16_t rate); //params/s, 0 - default
 
 void params_send(uint8_t component, uint8_t id);
 
 void params_set(uint8_t component, char *name, float value);
 
+void params_print_stats();
+
 void rpicam_emergency();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include "rx.h"
+#include "event.h"
+#include <stdio.h>
+#include <string.h>
+
+struct _S_RX_ENTRY {
+	t_rx_cb cb_fn;
+	uint32_t count;
+	uint32_t bytes; //whole frames, header and crc included
+	uint64_t time; //us spent in the handler
+	uint32_t time_max; //us
+};
+typedef struct _S_RX_ENTRY S_RX_ENTRY;
+
+static S_RX_ENTRY entry[256];
+
+static uint32_t unknown = 0; //messages without a handler
+
+static t_rx_batch_cb batch_cb[RX_MAX_BATCH_CB];
+static uint8_t batch_count = 0;
+
+extern uint8_t debug; //-d, see main.c
+
+void rx_init() {
+	memset(entry,0,sizeof(entry));
+	unknown = 0;
+	batch_count = 0;
+}
+
+uint8_t rx_register(uint8_t msgid, t_rx_cb cb) {
+	if (entry[msgid].cb_fn) {
+		printf("Handler for msgid %u already registered!\n",msgid);
+		return 1;
+	}
+
+	entry[msgid].cb_fn = cb;
+	return 0;
+}
+
+uint8_t rx_register_batch_end(t_rx_batch_cb cb) {
+	if (batch_count>=RX_MAX_BATCH_CB) {
+		printf("Too many batch handlers!\n");
+		return 1;
+	}
+
+	batch_cb[batch_count++] = cb;
+	return 0;
+}
+
+void rx_batch_end() {
+	uint8_t i;
+
+	for (i=0;i<batch_count;i++)
+		batch_cb[i]();
+}
+
+void rx_dispatch(mavlink_message_t *msg) {
+	S_RX_ENTRY *e = &entry[msg->msgid];
+	uint64_t start;
+	uint32_t dt;
+
+	if (debug) printf("<- MsgID: %u\n",msg->msgid);
+
+	e->count++;
+	e->bytes += msg->len + MAVLINK_NUM_NON_PAYLOAD_BYTES;
+
+	if (!e->cb_fn) {
+		unknown++;
+		return;
+	}
+
+	start = event_now_us();
+	e->cb_fn(msg);
+	dt = event_now_us() - start;
+
+	e->time += dt;
+	if (dt>e->time_max) e->time_max = dt;
+}
+
+uint32_t rx_get_count(uint8_t msgid) {
+	return entry[msgid].count;
+}
+
+uint32_t rx_get_unknown() {
+	return unknown;
+}
+
+void rx_print_stats() {
+	uint16_t i;
+	S_RX_ENTRY *e;
+
+	printf("RX: unknown=%u\n",unknown);
+	for (i=0;i<256;i++) {
+		e = &entry[i];
+		if (!e->count) continue;
+
+		if (e->cb_fn)
+			printf("RX msgid %3u: count=%u bytes=%u handler avg=%.1fus max=%uus total=%.1fms\n",
+				i,e->count,e->bytes,(float)e->time/e->count,e->time_max,e->time/1000.f);
+		else
+			printf("RX msgid %3u: count=%u bytes=%u no handler\n",i,e->count,e->bytes);
+	}
+}
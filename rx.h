@@ -0,0 +1,32 @@
+#ifndef _RX_H_
+#define _RX_H_
+
+#include <stdint.h>
+#include "mavlink/common/mavlink.h"
+
+/*
+	incoming message dispatch
+	every module registers handlers for the messages it owns, they are looked up by msgid in a 256 entry table
+	receive counts, bytes and time spent in the handler are kept per msgid
+*/
+
+typedef void (*t_rx_cb)(mavlink_message_t *msg);
+typedef void (*t_rx_batch_cb)();
+
+#define RX_MAX_BATCH_CB 4
+
+void rx_init();
+
+uint8_t rx_register(uint8_t msgid, t_rx_cb cb); //0 on success, 1 if the msgid already has a handler
+
+void rx_dispatch(mavlink_message_t *msg); //parser callback, see udp_recv
+
+uint8_t rx_register_batch_end(t_rx_batch_cb cb); //cb runs once all frames of a receive batch have been dispatched
+void rx_batch_end();
+
+uint32_t rx_get_count(uint8_t msgid);
+uint32_t rx_get_unknown();
+
+void rx_print_stats();
+
+#endif
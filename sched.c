@@ -0,0 +1,156 @@
+#include "sched.h"
+#include "event.h"
+#include <stdio.h>
+
+struct _S_SCHED_TASK {
+	t_sched_cb cb_fn;
+	uint16_t period; //ms, 0 - disabled
+	uint16_t pos; //position in the heap, SCHED_NONE if not queued
+	uint64_t next; //us
+};
+typedef struct _S_SCHED_TASK S_SCHED_TASK;
+
+static S_SCHED_TASK task[SCHED_MAX_TASK];
+static uint16_t task_count = 0;
+
+static uint16_t heap[SCHED_MAX_TASK]; //task ids, earliest deadline first
+static uint16_t heap_size = 0;
+
+static uint32_t runs = 0;
+static uint32_t skipped = 0; //periods skipped because the task was late by more than its period
+
+static void heap_swap(uint16_t a, uint16_t b) {
+	uint16_t t = heap[a];
+	heap[a] = heap[b];
+	heap[b] = t;
+	task[heap[a]].pos = a;
+	task[heap[b]].pos = b;
+}
+
+static void heap_up(uint16_t i) {
+	uint16_t p;
+	while (i) {
+		p = (i-1)/2;
+		if (task[heap[p]].next <= task[heap[i]].next) break;
+		heap_swap(i,p);
+		i = p;
+	}
+}
+
+static void heap_down(uint16_t i) {
+	uint16_t l, r, m;
+	while (1) {
+		l = 2*i+1;
+		r = l+1;
+		m = i;
+		if (l<heap_size && task[heap[l]].next < task[heap[m]].next) m = l;
+		if (r<heap_size && task[heap[r]].next < task[heap[m]].next) m = r;
+		if (m==i) break;
+		heap_swap(i,m);
+		i = m;
+	}
+}
+
+static void heap_push(uint16_t id) {
+	task[id].pos = heap_size;
+	heap[heap_size++] = id;
+	heap_up(task[id].pos);
+}
+
+static void heap_remove(uint16_t id) {
+	uint16_t i = task[id].pos;
+	if (i==SCHED_NONE) return;
+
+	task[id].pos = SCHED_NONE;
+	heap_size--;
+	if (i==heap_size) return;
+
+	heap[i] = heap[heap_size];
+	task[heap[i]].pos = i;
+	heap_up(i);
+	heap_down(task[heap[i]].pos);
+}
+
+void sched_init() {
+	task_count = 0;
+	heap_size = 0;
+}
+
+uint16_t sched_add(t_sched_cb cb, uint16_t period_ms, uint16_t phase_ms) {
+	uint16_t id;
+
+	if (task_count>=SCHED_MAX_TASK) {
+		printf("Scheduler full!\n");
+		return SCHED_NONE;
+	}
+
+	id = task_count++;
+	task[id].cb_fn = cb;
+	task[id].period = period_ms;
+	task[id].pos = SCHED_NONE;
+	task[id].next = event_now_us() + (uint64_t)phase_ms*1000;
+
+	if (period_ms) heap_push(id);
+
+	return id;
+}
+
+void sched_set_period(uint16_t id, uint16_t period_ms) {
+	S_SCHED_TASK *t;
+	uint64_t now;
+
+	if (id>=task_count) return;
+	t = &task[id];
+	if (t->period==period_ms) return;
+
+	now = event_now_us();
+
+	if (!period_ms) {
+		heap_remove(id);
+	} else if (t->pos==SCHED_NONE) { //re-enabled
+		t->next = now + (uint64_t)period_ms*1000;
+		heap_push(id);
+	} else { //keep the phase: next run is one new period after the previous run
+		t->next = t->next - (uint64_t)t->period*1000 + (uint64_t)period_ms*1000;
+		if (t->next<now) t->next = now;
+		heap_up(t->pos);
+		heap_down(t->pos);
+	}
+
+	t->period = period_ms;
+}
+
+uint16_t sched_get_period(uint16_t id) {
+	if (id>=task_count) return 0;
+	return task[id].period;
+}
+
+uint64_t sched_next() {
+	if (!heap_size) return UINT64_MAX;
+	return task[heap[0]].next;
+}
+
+void sched_run(uint64_t now) {
+	uint16_t id;
+	S_SCHED_TASK *t;
+
+	while (heap_size && task[heap[0]].next<=now) {
+		id = heap[0];
+		t = &task[id];
+
+		//re-queue before running so the callback is free to change periods
+		t->next += (uint64_t)t->period*1000;
+		if (t->next<=now) { //fell behind, do not try to catch up
+			skipped += (now-t->next)/((uint64_t)t->period*1000) + 1;
+			t->next = now + (uint64_t)t->period*1000;
+		}
+		heap_down(0);
+
+		runs++;
+		t->cb_fn();
+	}
+}
+
+void sched_print_stats() {
+	printf("Scheduler: tasks=%u queued=%u runs=%u skipped=%u\n",task_count,heap_size,runs,skipped);
+}
@@ -0,0 +1,29 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+
+/*
+	single task scheduler shared by all modules
+	tasks are kept in a min-heap ordered by their next deadline so picking the next task is O(1)
+	and re-queueing it is O(log n)
+	periods and phases are in milliseconds, a period of 0 disables the task
+*/
+
+#define SCHED_MAX_TASK 256
+#define SCHED_NONE UINT16_MAX
+
+typedef void (*t_sched_cb)();
+
+void sched_init();
+
+uint16_t sched_add(t_sched_cb cb, uint16_t period_ms, uint16_t phase_ms); //returns task id or SCHED_NONE
+void sched_set_period(uint16_t id, uint16_t period_ms);
+uint16_t sched_get_period(uint16_t id);
+
+uint64_t sched_next(); //absolute deadline (us, monotonic) of the next task; UINT64_MAX if there is none
+void sched_run(uint64_t now); //runs all tasks due at now (us)
+
+void sched_print_stats();
+
+#endif
@@ -39,6 +39,10 @@ void uart_close() {
         uart_fd = -1;
 }
 
+int uart_get_fd() {
+        return uart_fd;
+}
+
 void uart_send(mavlink_message_t *mavlink_msg) {
     int ret;
     ret = mavlink_msg_to_send_buffer(buf, mavlink_msg);
@@ -48,29 +52,15 @@ void uart_send(mavlink_message_t *mavlink_msg) {
     }
 }
 
-uint8_t uart_recv(mavlink_message_t *msg) {
-	static ssize_t recsize = 0;
-	static int i = 0;
-	static mavlink_status_t status;
+uint16_t uart_recv(mavlink_parse_cb_t cb) {
+	uint16_t frames = 0;
+	int i;
 
-	i = read(uart_fd, (void *)buf+recsize, BUFFER_LENGTH-recsize);
-	if (i >= 0) {
-		recsize += i;
-		for (i = 0; i < recsize; ++i)
-		{
+	//a frame split between reads is carried over by the parser
+	while ((i = read(uart_fd, (void *)buf, BUFFER_LENGTH)) > 0)
+		frames += mavlink_parse_buffer(MAVLINK_COMM_0, buf, i, cb);
 
-			if (mavlink_parse_char(MAVLINK_COMM_0, buf[i], msg, &status))
-			{
-				if ((i+1)<recsize) {
-					memmove(buf,buf+i,recsize-i);
-					recsize -= i;
-				}
-				return 1;
-			}
-		}
-	} else {
-		perror("UART: Error reading");
-	}
+	if (i < 0 && errno != EAGAIN) perror("UART: Error reading");
 
-	return 0;
+	return frames;
 }
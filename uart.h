@@ -7,8 +7,10 @@ void uart_init(const char *path);
 
 void uart_send(mavlink_message_t *mavlink_msg);
 
-uint8_t uart_recv(mavlink_message_t *msg);
+uint16_t uart_recv(mavlink_parse_cb_t cb);
 
 void uart_close();
 
+int uart_get_fd();
+
 #endif
\ No newline at end of file
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE //recvmmsg, sendmmsg
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
@@ -12,23 +13,121 @@
 #include <time.h>
 #include <arpa/inet.h>
 #include "udp.h"
+#include "event.h"
 
 #define BUFFER_LENGTH 2021
+#define RX_BATCH 16 //datagrams pulled per recvmmsg
+#define RX_CONTROL_LEN (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+#define TX_MTU 1472 //largest UDP payload that is not fragmented on a 1500 byte link MTU
+#define TX_MAX_DGRAM 16 //datagrams handed to a single sendmmsg
+#define TX_MAX_IOV 64 //frames gathered into one datagram
+#define TX_SLOTS 320 //sum of tx_depth
+#define TX_BURST_MS 100 //bucket depth, how far the link may get ahead of its budget
 
 static int sock;
 
 static struct sockaddr_in gcAddr; 
 static struct sockaddr_in locAddr;
 
-static uint8_t buf[BUFFER_LENGTH];
-static int bytes_sent;
-static uint16_t len;
+static struct sockaddr_in extraAddr[UDP_MAX_TARGET]; //additional destinations that get a copy of every datagram
+static uint8_t extra_count = 0;
+
+static S_LATENCY rx_latency; //kernel receive timestamp -> datagram read
+static uint64_t rx_stamp_cur = 0; //us, monotonic receive time of the datagram being parsed
+
+//receive batch
+static uint8_t rx_buf[RX_BATCH][BUFFER_LENGTH];
+static uint8_t rx_control[RX_BATCH][RX_CONTROL_LEN];
+static struct iovec rx_iov[RX_BATCH];
+static struct mmsghdr rx_msgs[RX_BATCH];
+static int rx_count = 0; //datagrams in the batch
+static uint64_t rx_stamp[RX_BATCH]; //us, monotonic receive time of every datagram in the batch
+
+static uint32_t rx_syscalls = 0;
+static uint32_t rx_datagrams = 0;
+static uint32_t rx_frames = 0;
+static uint32_t rx_kernel_drops = 0; //SO_RXQ_OVFL, datagrams dropped by the kernel on a full socket queue
+
+//transmit queues, one per priority class; frames wait in their slots until udp_flush
+//a full queue drops its oldest frame, for telemetry the newest sample is the useful one
+struct _S_TX_QUEUE {
+	uint16_t base; //first slot
+	uint16_t depth; //slots
+	uint16_t head; //oldest frame, relative to base
+	uint16_t count;
+	uint16_t max_count;
+	uint32_t frames; //sent
+	uint32_t drops;
+};
+typedef struct _S_TX_QUEUE S_TX_QUEUE;
+
+static const uint16_t tx_depth[TX_PRIO_COUNT] = {32, 8, 8, 16, 256}; //bulk holds a whole param list
+static const char *tx_prio_name[TX_PRIO_COUNT] = {"ack", "heartbeat", "attitude", "position", "bulk"};
+
+static S_TX_QUEUE tx_q[TX_PRIO_COUNT];
+static uint8_t tx_slot[TX_SLOTS][MAVLINK_MAX_PACKET_LEN];
+static uint16_t tx_slot_len[TX_SLOTS];
+static uint8_t tx_prio[256]; //msgid -> priority class
+
+//datagrams of the current flush, gathered straight from the queue slots
+static struct iovec tx_iov[TX_MAX_DGRAM][TX_MAX_IOV];
+static uint8_t tx_iovcnt[TX_MAX_DGRAM];
+static uint16_t tx_len[TX_MAX_DGRAM];
+static uint8_t tx_count = 0; //datagrams in use, the last one is being filled
+static struct mmsghdr tx_msgs[TX_MAX_DGRAM*(UDP_MAX_TARGET+1)];
+
+//link budget (token bucket), counts MAVLink bytes only
+static uint32_t tx_budget = 0; //bytes/s, 0 - unlimited
+static uint32_t tx_burst = 0; //bytes
+static uint32_t tx_tokens = 0; //bytes
+static uint64_t tx_refill = 0; //us, tokens are accounted up to this time
+static uint8_t tx_dry = 0; //frames had to wait since the last udp_get_pressure
+static uint32_t tx_low = 0; //fewest tokens left by a flush since the last udp_get_pressure
+
+static uint32_t tx_syscalls = 0;
+static uint32_t tx_datagrams = 0; //datagrams put on the wire, one per destination
+static uint32_t tx_packed = 0; //datagrams built
+static uint32_t tx_frames = 0;
+static uint32_t tx_errors = 0; //datagrams the kernel refused
+static uint32_t tx_deferred = 0; //flushes that left frames queued for lack of budget
+
+static uint16_t tx_frame; //slot being built in place by dispatch_begin/dispatch_end
+static uint8_t tx_frame_prio;
+static uint8_t tx_msgid;
+static uint8_t tx_payload_len;
 
 
 void dispatch(mavlink_message_t *mavlink_msg) {
 	udp_send(mavlink_msg);
 }
 
+static void udp_tx_init() {
+	uint8_t i;
+	uint16_t base = 0;
+
+	for (i=0;i<TX_PRIO_COUNT;i++) {
+		memset(&tx_q[i], 0, sizeof(S_TX_QUEUE));
+		tx_q[i].base = base;
+		tx_q[i].depth = tx_depth[i];
+		base += tx_depth[i];
+	}
+
+	memset(tx_prio, TX_PRIO_BULK, sizeof(tx_prio));
+	tx_prio[MAVLINK_MSG_ID_COMMAND_ACK] = TX_PRIO_ACK;
+	tx_prio[MAVLINK_MSG_ID_MESSAGE_INTERVAL] = TX_PRIO_ACK;
+	tx_prio[MAVLINK_MSG_ID_MISSION_COUNT] = TX_PRIO_ACK;
+	tx_prio[MAVLINK_MSG_ID_HEARTBEAT] = TX_PRIO_HEARTBEAT;
+	tx_prio[MAVLINK_MSG_ID_ATTITUDE] = TX_PRIO_ATTITUDE;
+	tx_prio[MAVLINK_MSG_ID_ATTITUDE_QUATERNION] = TX_PRIO_ATTITUDE;
+	tx_prio[MAVLINK_MSG_ID_GPS_RAW_INT] = TX_PRIO_POSITION;
+	tx_prio[MAVLINK_MSG_ID_GLOBAL_POSITION_INT] = TX_PRIO_POSITION;
+	tx_prio[MAVLINK_MSG_ID_HOME_POSITION] = TX_PRIO_POSITION;
+	tx_prio[MAVLINK_MSG_ID_ALTITUDE] = TX_PRIO_POSITION;
+
+	tx_count = 0;
+	udp_set_budget(tx_budget);
+}
+
 void udp_init(const char *target, const int target_port, const int local_port) {
 	sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
@@ -54,7 +153,19 @@ void udp_init(const char *target, const int target_port, const int local_port) {
 		close(sock);
 		exit(EXIT_FAILURE);
     }
- 
+
+	/* Kernel receive timestamps for latency reporting */
+	int on = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+		perror("setsockopt SO_TIMESTAMPNS");
+	latency_reset(&rx_latency);
+
+	/* Kernel drop counter delivered with every datagram */
+	if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+		perror("setsockopt SO_RXQ_OVFL");
+
+	rx_count = 0;
+	udp_tx_init();
  
 	memset(&gcAddr, 0, sizeof(gcAddr));
 	gcAddr.sin_family = AF_INET;
@@ -64,46 +175,331 @@ void udp_init(const char *target, const int target_port, const int local_port) {
 	printf("GC address: %s:%i\n",inet_ntoa(gcAddr.sin_addr),target_port);
 }
 
+uint8_t udp_add_target(const char *target, const int target_port) {
+	struct sockaddr_in *a;
+
+	if (extra_count>=UDP_MAX_TARGET) return 1;
+
+	a = &extraAddr[extra_count++];
+	memset(a, 0, sizeof(struct sockaddr_in));
+	a->sin_family = AF_INET;
+	a->sin_addr.s_addr = inet_addr(target);
+	a->sin_port = htons(target_port);
+
+	printf("Additional GC address: %s:%i\n",inet_ntoa(a->sin_addr),target_port);
+	return 0;
+}
+
+uint8_t udp_get_target_count() {
+	return extra_count;
+}
+
+void udp_set_budget(uint32_t bytes_per_s) {
+	tx_budget = bytes_per_s;
+	tx_burst = bytes_per_s*TX_BURST_MS/1000;
+	if (tx_burst<MAVLINK_MAX_PACKET_LEN) tx_burst = MAVLINK_MAX_PACKET_LEN; //the largest frame has to fit eventually
+	tx_tokens = tx_burst;
+	tx_low = tx_burst;
+	tx_refill = event_now_us();
+}
+
+uint8_t udp_get_prio(uint8_t msgid) {
+	return tx_prio[msgid];
+}
+
+uint8_t udp_get_pressure() {
+	uint8_t ret;
+
+	if (tx_dry) ret = UDP_TX_DRY;
+	else if (!tx_budget || tx_low>tx_burst/2) ret = UDP_TX_IDLE;
+	else ret = UDP_TX_OK;
+
+	tx_dry = 0;
+	tx_low = tx_burst;
+	return ret;
+}
+
+uint8_t udp_get_txbuf() {
+	if (!tx_budget) return 100;
+	return tx_tokens*100/tx_burst;
+}
+
+static void udp_refill() {
+	uint64_t now = event_now_us();
+	uint64_t add;
+
+	if (!tx_budget) return;
+
+	add = (now-tx_refill)*tx_budget/1000000;
+	if (tx_tokens+add>=tx_burst) {
+		tx_tokens = tx_burst;
+		tx_refill = now;
+	} else {
+		tx_tokens += add;
+		tx_refill += add*1000000/tx_budget; //the fraction of a byte is kept for the next refill
+	}
+}
+
+//sends the datagrams built so far to every destination with as few syscalls as possible
+static void udp_send_dgrams() {
+	uint8_t i,j;
+	int n = 0, sent = 0, ret;
+	struct sockaddr_in *addr;
+
+	if (!tx_count) return;
+
+	for (j=0;j<=extra_count;j++) {
+		addr = j?&extraAddr[j-1]:&gcAddr;
+		for (i=0;i<tx_count;i++) {
+			if (!j) tx_packed++;
+			memset(&tx_msgs[n], 0, sizeof(struct mmsghdr));
+			tx_msgs[n].msg_hdr.msg_name = addr;
+			tx_msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			tx_msgs[n].msg_hdr.msg_iov = tx_iov[i];
+			tx_msgs[n].msg_hdr.msg_iovlen = tx_iovcnt[i];
+			n++;
+		}
+	}
+
+	while (sent<n) {
+		tx_syscalls++;
+		ret = sendmmsg(sock, &tx_msgs[sent], n-sent, 0);
+		if (ret<=0) { //the first datagram was refused (e.g. its target is unreachable), drop it and go on with the others
+			tx_errors++;
+			sent++;
+			continue;
+		}
+		sent += ret;
+		tx_datagrams += ret;
+	}
+
+	tx_count = 0;
+}
+
+//sends queued frames in priority order as far as the budget allows, packed into MTU sized datagrams
+void udp_flush() {
+	uint8_t p;
+	uint8_t dry = 0;
+	uint16_t slot, len;
+	S_TX_QUEUE *q;
+
+	udp_refill();
+
+	for (p=0;p<TX_PRIO_COUNT && !dry;p++) {
+		q = &tx_q[p];
+		while (q->count) {
+			slot = q->base + q->head;
+			len = tx_slot_len[slot];
+
+			if (tx_budget && len>tx_tokens) { //out of budget, the rest waits for the next flush
+				dry = 1;
+				break;
+			}
+
+			if (!tx_count || tx_len[tx_count-1]+len>TX_MTU || tx_iovcnt[tx_count-1]==TX_MAX_IOV) {
+				if (tx_count==TX_MAX_DGRAM) udp_send_dgrams();
+				tx_len[tx_count] = 0;
+				tx_iovcnt[tx_count++] = 0;
+			}
+
+			tx_iov[tx_count-1][tx_iovcnt[tx_count-1]].iov_base = tx_slot[slot];
+			tx_iov[tx_count-1][tx_iovcnt[tx_count-1]].iov_len = len;
+			tx_iovcnt[tx_count-1]++;
+			tx_len[tx_count-1] += len;
+			if (tx_budget) tx_tokens -= len;
+
+			q->head = (q->head+1)%q->depth;
+			q->count--;
+			q->frames++;
+			tx_frames++;
+		}
+	}
+
+	udp_send_dgrams(); //the slots stay untouched until then, nothing is queued during a flush
+
+	if (dry) {
+		tx_dry = 1;
+		tx_deferred++;
+	}
+	if (tx_tokens<tx_low) tx_low = tx_tokens;
+}
+
+//reserves a slot in the frame's priority queue; it has to be followed by udp_commit
+static uint8_t *udp_reserve(uint8_t msgid) {
+	S_TX_QUEUE *q = &tx_q[tx_prio[msgid]];
+
+	if (q->count==q->depth) { //full, drop the oldest frame
+		q->head = (q->head+1)%q->depth;
+		q->count--;
+		q->drops++;
+	}
+
+	tx_frame = q->base + (q->head+q->count)%q->depth;
+	tx_frame_prio = tx_prio[msgid];
+	return tx_slot[tx_frame];
+}
+
+static void udp_commit(uint16_t size) {
+	S_TX_QUEUE *q = &tx_q[tx_frame_prio];
+
+	tx_slot_len[tx_frame] = size;
+	q->count++;
+	if (q->count>q->max_count) q->max_count = q->count;
+}
+
+//starts a frame directly in the transmit queue and returns where its payload goes
+uint8_t *dispatch_begin(uint8_t msgid, uint8_t len) {
+	tx_msgid = msgid;
+	tx_payload_len = len;
+	return udp_reserve(msgid) + MAVLINK_NUM_HEADER_BYTES;
+}
+
+//completes the frame started by dispatch_begin: header and CRC are written in place
+void dispatch_end(uint8_t sysid, uint8_t compid, uint8_t crc_extra) {
+	uint8_t *p = tx_slot[tx_frame];
+	mavlink_status_t *status = mavlink_get_channel_status(MAVLINK_COMM_0);
+	uint16_t checksum;
+
+	p[0] = MAVLINK_STX;
+	p[1] = tx_payload_len;
+	p[2] = status->current_tx_seq++;
+	p[3] = sysid;
+	p[4] = compid;
+	p[5] = tx_msgid;
+
+	checksum = crc_calculate(p+1, MAVLINK_CORE_HEADER_LEN);
+	crc_accumulate_buffer(&checksum, (const char *)p+MAVLINK_NUM_HEADER_BYTES, tx_payload_len);
+#if MAVLINK_CRC_EXTRA
+	crc_accumulate(crc_extra, &checksum);
+#endif
+	p[MAVLINK_NUM_HEADER_BYTES+tx_payload_len] = (uint8_t)(checksum & 0xFF);
+	p[MAVLINK_NUM_HEADER_BYTES+tx_payload_len+1] = (uint8_t)(checksum >> 8);
+
+	udp_commit(MAVLINK_NUM_NON_PAYLOAD_BYTES + tx_payload_len);
+}
+
+//queues a frame from a wire-ordered payload (mavlink_xxx_t) without going through mavlink_message_t
+void dispatch_payload(uint8_t sysid, uint8_t compid, uint8_t msgid, const void *payload, uint8_t len, uint8_t crc_extra) {
+	memcpy(dispatch_begin(msgid, len), payload, len);
+	dispatch_end(sysid, compid, crc_extra);
+}
+
+//queues a frame, it is sent on the next udp_flush
 void udp_send(mavlink_message_t *mavlink_msg) {
-	len = mavlink_msg_to_send_buffer(buf, mavlink_msg);
-	bytes_sent = sendto(sock, buf, len, 0, (struct sockaddr*)&gcAddr, sizeof(struct sockaddr_in));
-}
-
-uint8_t udp_recv(mavlink_message_t *msg) {
-	static ssize_t recsize;
-	static socklen_t fromlen;
-	static int i = 0;
-	static mavlink_status_t status;
-	//static unsigned int temp = 0;
-	//struct sockaddr_in gcAddr;
-
-	memset(buf, 0, BUFFER_LENGTH);
-	recsize = recvfrom(sock, (void *)buf, BUFFER_LENGTH, 0, (struct sockaddr *)&gcAddr, &fromlen);
-	if (recsize > 0)
-		{
-		// Something received - print out all bytes and parse packet
-		//printf("Bytes Received: %d\nDatagram: ", (int)recsize);
-		//printf("Received packet from: %s\n",inet_ntoa(gcAddr.sin_addr));
-		for (i = 0; i < recsize; ++i)
-		{
-			//temp = buf[i];
-			//printf("%02x ", (unsigned char)temp);
-			if (mavlink_parse_char(MAVLINK_COMM_0, buf[i], msg, &status))
-			{
-				// Packet received
-				//printf("\nReceived packet: SYS: %d, COMP: %d, LEN: %d, MSG ID: %d\n\n", msg->sysid, msg->compid, msg->len, msg->msgid);
-				return 1;
+	uint8_t *p = udp_reserve(mavlink_msg->msgid);
+	udp_commit(mavlink_msg_to_send_buffer(p, mavlink_msg));
+}
+
+//returns when the kernel received the datagram (us, monotonic); read time if there is no timestamp
+static uint64_t udp_rx_control(struct msghdr *mh) {
+	struct cmsghdr *cmsg;
+	struct timespec *stamp, now;
+	int64_t d;
+	uint64_t ret = event_now_us();
+
+	for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+		if (cmsg->cmsg_level!=SOL_SOCKET) continue;
+
+		if (cmsg->cmsg_type==SCM_TIMESTAMPNS) {
+			stamp = (struct timespec *)CMSG_DATA(cmsg);
+			clock_gettime(CLOCK_REALTIME, &now);
+			d = (int64_t)(now.tv_sec-stamp->tv_sec)*1000000 + (now.tv_nsec-stamp->tv_nsec)/1000;
+			if (d>=0) {
+				latency_add(&rx_latency, d);
+				ret -= d;
 			}
+		} else if (cmsg->cmsg_type==SO_RXQ_OVFL) {
+			memcpy(&rx_kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
 		}
-	};
+	}
 
-	return 0;
+	return ret;
+}
+
+//pulls up to RX_BATCH datagrams with a single syscall
+static int udp_rx_batch() {
+	int i;
+
+	for (i=0;i<RX_BATCH;i++) {
+		rx_iov[i].iov_base = rx_buf[i];
+		rx_iov[i].iov_len = BUFFER_LENGTH;
+		memset(&rx_msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+		rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+		rx_msgs[i].msg_hdr.msg_iovlen = 1;
+		rx_msgs[i].msg_hdr.msg_control = rx_control[i];
+		rx_msgs[i].msg_hdr.msg_controllen = RX_CONTROL_LEN;
+	}
+
+	rx_syscalls++;
+	rx_count = recvmmsg(sock, rx_msgs, RX_BATCH, MSG_DONTWAIT, NULL);
+
+	if (rx_count<=0) {
+		rx_count = 0;
+		return 0;
+	}
+
+	rx_datagrams += rx_count;
+	for (i=0;i<rx_count;i++)
+		rx_stamp[i] = udp_rx_control(&rx_msgs[i].msg_hdr);
+
+	return rx_count;
+}
+
+//drains the socket and hands every frame to cb; returns the number of frames delivered
+uint16_t udp_recv(mavlink_parse_cb_t cb) {
+	uint16_t frames = 0;
+	int i;
+
+	while (udp_rx_batch()) {
+		for (i=0;i<rx_count;i++) {
+			rx_stamp_cur = rx_stamp[i];
+			frames += mavlink_parse_buffer(MAVLINK_COMM_0, rx_buf[i], rx_msgs[i].msg_len, cb);
+		}
+		if (rx_count<RX_BATCH) break; //socket is empty
+	}
+
+	rx_frames += frames;
+	return frames;
 }
 
 void udp_close() {
+	udp_flush();
 	close(sock);
 }
 
+int udp_get_fd() {
+	return sock;
+}
+
+uint64_t udp_get_rx_stamp() {
+	return rx_stamp_cur;
+}
+
+uint32_t udp_get_rx_drops() {
+	return rx_kernel_drops;
+}
+
+void udp_print_stats() {
+	static uint64_t prev_time = 0;
+	static uint32_t prev_syscalls = 0;
+	uint64_t now = event_now_us();
+	float dt = prev_time?(now-prev_time)/1000000.f:0.f;
+	uint8_t i;
+
+	printf("UDP rx: syscalls=%u datagrams=%u frames=%u kernel_drops=%u\n",rx_syscalls,rx_datagrams,rx_frames,rx_kernel_drops);
+	printf("UDP tx: syscalls=%u (%.1f/s) datagrams=%u frames=%u (%.1f/datagram) errors=%u\n",
+		tx_syscalls, dt>0?(tx_syscalls-prev_syscalls)/dt:0.f,
+		tx_datagrams, tx_frames, tx_packed?(float)tx_frames/tx_packed:0.f, tx_errors);
+	prev_time = now;
+	prev_syscalls = tx_syscalls;
+
+	if (tx_budget) printf("UDP tx budget: %u bytes/s tokens=%u deferred=%u\n",tx_budget,tx_tokens,tx_deferred);
+	for (i=0;i<TX_PRIO_COUNT;i++)
+		printf("UDP tx %s: depth=%u max=%u frames=%u drops=%u\n",tx_prio_name[i],tx_q[i].count,tx_q[i].max_count,tx_q[i].frames,tx_q[i].drops);
+
+	latency_print("UDP receive latency",&rx_latency);
+}
+
 char * get_gc_ip() {
 	static char ip[16];
 	sprintf(ip,"%s",inet_ntoa(gcAddr.sin_addr));
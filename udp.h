@@ -3,15 +3,63 @@
 
 #include "mavlink/common/mavlink.h"
 
+#define UDP_MAX_TARGET 4 //additional destinations on top of the GC address
+
+//outbound priority classes, a class is only sent once all the classes before it are empty
+enum {
+	TX_PRIO_ACK = 0, //command responses
+	TX_PRIO_HEARTBEAT,
+	TX_PRIO_ATTITUDE,
+	TX_PRIO_POSITION,
+	TX_PRIO_BULK, //params, status and everything else
+	TX_PRIO_COUNT
+};
+
+//link budget state, see udp_get_pressure
+#define UDP_TX_IDLE 0 //plenty of headroom (or no budget set)
+#define UDP_TX_OK 1
+#define UDP_TX_DRY 2 //the budget ran out and frames had to wait or were dropped
+
 void udp_init(const char *target, const int target_port, const int local_port);
 
+uint8_t udp_add_target(const char *target, const int target_port);
+uint8_t udp_get_target_count(); //additional targets (-a), they get everything and never send a heartbeat
+
 void udp_send(mavlink_message_t *mavlink_msg);
 
-uint8_t udp_recv(mavlink_message_t *msg);
+void udp_flush();
+
+void udp_set_budget(uint32_t bytes_per_s); //0 - unlimited
+uint8_t udp_get_prio(uint8_t msgid);
+uint8_t udp_get_pressure(); //state since the previous call
+uint8_t udp_get_txbuf(); //% of the budget left, 100 if unlimited
+
+uint16_t udp_recv(mavlink_parse_cb_t cb); //calls cb for every received frame
 
 void udp_close();
 
+int udp_get_fd();
+
+uint64_t udp_get_rx_stamp(); //us (monotonic), when the frame being handled by the udp_recv callback was received
+
+uint32_t udp_get_rx_drops();
+
+void udp_print_stats();
+
 void dispatch(mavlink_message_t *mavlink_msg);
 
+//zero-copy transmit: the frame is serialized straight into the transmit queue
+uint8_t *dispatch_begin(uint8_t msgid, uint8_t len);
+void dispatch_end(uint8_t sysid, uint8_t compid, uint8_t crc_extra);
+void dispatch_payload(uint8_t sysid, uint8_t compid, uint8_t msgid, const void *payload, uint8_t len, uint8_t crc_extra);
+
+//serializes a mavlink_xxx_t straight into the transmit queue (no mavlink_message_t in between)
+//the copy is done here rather than by dispatch_payload so it has the constant size of the message and is inlined
+//see utils/bench_dispatch.c
+#define DISPATCH(NAME, packet) do { \
+		memcpy(dispatch_begin(MAVLINK_MSG_ID_##NAME, MAVLINK_MSG_ID_##NAME##_LEN), &(packet), MAVLINK_MSG_ID_##NAME##_LEN); \
+		dispatch_end(1, 200, MAVLINK_MSG_ID_##NAME##_CRC); \
+	} while (0)
+
 char * get_gc_ip();
 #endif
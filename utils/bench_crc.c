@@ -0,0 +1,125 @@
+/*
+	bench_crc: X.25 CRC of mavlink/checksum.h, slicing-by-8 against the byte-wise crc_accumulate loop
+	first checks that both give the same CRC on random buffers (every length 0..255, any start value and alignment,
+	split into random chunks through crc_accumulate_buffer), then measures MB/s for every payload length 1..255
+
+	usage: bench_crc [rounds] [-v]
+	exits with 1 if the two implementations disagree
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mavlink/checksum.h"
+
+#ifndef MAVLINK_CRC_SLICE8
+#error "checksum.h was built without slicing-by-8, nothing to compare"
+#endif
+
+#define MAX_LEN 255
+#define CHECKS 100000 //random buffers checked
+
+//the reference: one byte at a time, as crc_calculate was before slicing-by-8
+static uint16_t crc_bytewise(uint16_t crc, const uint8_t *p, uint16_t length) {
+	while (length--) crc_accumulate(*p++, &crc);
+	return crc;
+}
+
+static uint16_t crc_slice8(uint16_t crc, const uint8_t *p, uint16_t length) {
+	crc_accumulate_buffer(&crc, (const char *)p, length);
+	return crc;
+}
+
+typedef uint16_t (*t_crc)(uint16_t crc, const uint8_t *p, uint16_t length);
+
+static double now_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1e9+t.tv_nsec;
+}
+
+//returns the number of mismatches
+static uint32_t check() {
+	static uint8_t buf[MAX_LEN+8];
+	uint32_t i, j, failed = 0;
+	uint16_t len, off, pos, n, ref, crc, init;
+
+	srand(1);
+	for (i=0;i<CHECKS;i++) {
+		len = i%(MAX_LEN+1);
+		off = rand()%8; //start at any alignment
+		init = i&1?X25_INIT_CRC:rand();
+		for (j=0;j<len;j++) buf[off+j] = rand();
+
+		ref = crc_bytewise(init,buf+off,len);
+
+		//whole buffer, and through crc_calculate when it starts from the initial value
+		crc = crc_slice8(init,buf+off,len);
+		if (init==X25_INIT_CRC && crc_calculate(buf+off,len)!=ref) crc = ~ref;
+
+		//the same buffer in random chunks, as the header and payload of a frame are
+		if (crc==ref) {
+			crc = init;
+			for (pos=0;pos<len;pos+=n) {
+				n = 1+rand()%(len-pos);
+				crc = crc_slice8(crc,buf+off+pos,n);
+			}
+		}
+
+		if (crc!=ref) {
+			if (failed<10) printf("mismatch: length %u, offset %u, init 0x%04x\n",len,off,init);
+			failed++;
+		}
+	}
+	return failed;
+}
+
+//MB/s for one length, the best of 3 runs
+static double speed(t_crc fn, const uint8_t *buf, uint16_t len, uint32_t rounds) {
+	volatile uint16_t sink;
+	uint16_t crc = X25_INIT_CRC;
+	uint32_t r, j;
+	double t, best = 0;
+
+	for (r=0;r<3;r++) {
+		t = now_ns();
+		for (j=0;j<rounds;j++) crc = fn(crc,buf,len); //chained so the calls cannot be dropped or overlapped
+		t = now_ns()-t;
+		if (!r || t<best) best = t;
+	}
+	sink = crc;
+	(void)sink;
+
+	return (double)len*rounds/best*1e3;
+}
+
+int main(int argc, char **argv) {
+	static uint8_t buf[MAX_LEN];
+	uint32_t rounds = 20000, failed, i;
+	uint16_t len;
+	uint8_t verbose = 0;
+	double b, s, b_sum = 0, s_sum = 0;
+
+	for (i=1;i<argc;i++) {
+		if (!strcmp(argv[i],"-v")) verbose = 1;
+		else rounds = atoi(argv[i]);
+	}
+	if (!rounds) rounds = 1;
+
+	failed = check();
+	printf("%u random buffers: %s\n",CHECKS,failed?"MISMATCH":"slicing-by-8 matches the byte-wise CRC");
+
+	for (i=0;i<sizeof(buf);i++) buf[i] = rand();
+
+	for (len=1;len<=MAX_LEN;len++) {
+		b = speed(crc_bytewise,buf,len,rounds);
+		s = speed(crc_slice8,buf,len,rounds);
+		b_sum += b;
+		s_sum += s;
+		if (verbose || len==1 || len==8 || len==9 || len==28 || len==64 || len==MAX_LEN)
+			printf("%3u B  byte-wise %7.1f MB/s  slice8 %7.1f MB/s  x%.2f\n",len,b,s,s/b);
+	}
+	printf("mean over 1..%u B: byte-wise %.1f MB/s, slice8 %.1f MB/s, x%.2f\n",MAX_LEN,b_sum/MAX_LEN,s_sum/MAX_LEN,s_sum/b_sum);
+
+	return failed?1:0;
+}
@@ -0,0 +1,274 @@
+/*
+	bench_dispatch: cost of queueing a telemetry frame, for every message of mavlink/common
+	old: mavlink_msg_xxx_encode into a mavlink_message_t, then dispatch() copies it into the transmit queue
+	new: DISPATCH (udp.h) as mavlink.c uses it, payload copied at its constant size, header and CRC written in place
+	every message is first checked to come out byte-identical both ways (HEARTBEAT excepted, _encode sets mavlink_version)
+	the datagrams never leave: sendmmsg is replaced below and only records the first one
+
+	usage: bench_dispatch [frames per message] [-v]
+*/
+#define _GNU_SOURCE //sendmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "../udp.h"
+
+uint64_t start_time;
+
+static mavlink_message_t mav_msg;
+static uint8_t sent[MAVLINK_MAX_PACKET_LEN];
+static uint16_t sent_len;
+
+//stands in for the kernel: keeps the first datagram of a flush
+int sendmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags) {
+	struct msghdr *h = &msgs[0].msg_hdr;
+	size_t i;
+
+	sent_len = 0;
+	for (i=0;i<h->msg_iovlen;i++) {
+		if (sent_len+h->msg_iov[i].iov_len>sizeof(sent)) break;
+		memcpy(sent+sent_len,h->msg_iov[i].iov_base,h->msg_iov[i].iov_len);
+		sent_len += h->msg_iov[i].iov_len;
+	}
+	return n;
+}
+
+#define MAVLINK_COMMON_MESSAGES \
+	MSG(ACTUATOR_CONTROL_TARGET, actuator_control_target) \
+	MSG(ADSB_VEHICLE, adsb_vehicle) \
+	MSG(ALTITUDE, altitude) \
+	MSG(ATT_POS_MOCAP, att_pos_mocap) \
+	MSG(ATTITUDE, attitude) \
+	MSG(ATTITUDE_QUATERNION, attitude_quaternion) \
+	MSG(ATTITUDE_QUATERNION_COV, attitude_quaternion_cov) \
+	MSG(ATTITUDE_TARGET, attitude_target) \
+	MSG(AUTH_KEY, auth_key) \
+	MSG(AUTOPILOT_VERSION, autopilot_version) \
+	MSG(BATTERY_STATUS, battery_status) \
+	MSG(CAMERA_TRIGGER, camera_trigger) \
+	MSG(CHANGE_OPERATOR_CONTROL, change_operator_control) \
+	MSG(CHANGE_OPERATOR_CONTROL_ACK, change_operator_control_ack) \
+	MSG(COMMAND_ACK, command_ack) \
+	MSG(COMMAND_INT, command_int) \
+	MSG(COMMAND_LONG, command_long) \
+	MSG(CONTROL_SYSTEM_STATE, control_system_state) \
+	MSG(DATA_STREAM, data_stream) \
+	MSG(DATA_TRANSMISSION_HANDSHAKE, data_transmission_handshake) \
+	MSG(DEBUG, debug) \
+	MSG(DEBUG_VECT, debug_vect) \
+	MSG(DISTANCE_SENSOR, distance_sensor) \
+	MSG(ENCAPSULATED_DATA, encapsulated_data) \
+	MSG(EXTENDED_SYS_STATE, extended_sys_state) \
+	MSG(FILE_TRANSFER_PROTOCOL, file_transfer_protocol) \
+	MSG(GLOBAL_POSITION_INT, global_position_int) \
+	MSG(GLOBAL_POSITION_INT_COV, global_position_int_cov) \
+	MSG(GLOBAL_VISION_POSITION_ESTIMATE, global_vision_position_estimate) \
+	MSG(GPS2_RAW, gps2_raw) \
+	MSG(GPS2_RTK, gps2_rtk) \
+	MSG(GPS_GLOBAL_ORIGIN, gps_global_origin) \
+	MSG(GPS_INJECT_DATA, gps_inject_data) \
+	MSG(GPS_RAW_INT, gps_raw_int) \
+	MSG(GPS_RTK, gps_rtk) \
+	MSG(GPS_STATUS, gps_status) \
+	MSG(HEARTBEAT, heartbeat) \
+	MSG(HIGHRES_IMU, highres_imu) \
+	MSG(HIL_CONTROLS, hil_controls) \
+	MSG(HIL_GPS, hil_gps) \
+	MSG(HIL_OPTICAL_FLOW, hil_optical_flow) \
+	MSG(HIL_RC_INPUTS_RAW, hil_rc_inputs_raw) \
+	MSG(HIL_SENSOR, hil_sensor) \
+	MSG(HIL_STATE, hil_state) \
+	MSG(HIL_STATE_QUATERNION, hil_state_quaternion) \
+	MSG(HOME_POSITION, home_position) \
+	MSG(LANDING_TARGET, landing_target) \
+	MSG(LOCAL_POSITION_NED, local_position_ned) \
+	MSG(LOCAL_POSITION_NED_COV, local_position_ned_cov) \
+	MSG(LOCAL_POSITION_NED_SYSTEM_GLOBAL_OFFSET, local_position_ned_system_global_offset) \
+	MSG(LOG_DATA, log_data) \
+	MSG(LOG_ENTRY, log_entry) \
+	MSG(LOG_ERASE, log_erase) \
+	MSG(LOG_REQUEST_DATA, log_request_data) \
+	MSG(LOG_REQUEST_END, log_request_end) \
+	MSG(LOG_REQUEST_LIST, log_request_list) \
+	MSG(MANUAL_CONTROL, manual_control) \
+	MSG(MANUAL_SETPOINT, manual_setpoint) \
+	MSG(MEMORY_VECT, memory_vect) \
+	MSG(MESSAGE_INTERVAL, message_interval) \
+	MSG(MISSION_ACK, mission_ack) \
+	MSG(MISSION_CLEAR_ALL, mission_clear_all) \
+	MSG(MISSION_COUNT, mission_count) \
+	MSG(MISSION_CURRENT, mission_current) \
+	MSG(MISSION_ITEM, mission_item) \
+	MSG(MISSION_ITEM_INT, mission_item_int) \
+	MSG(MISSION_ITEM_REACHED, mission_item_reached) \
+	MSG(MISSION_REQUEST, mission_request) \
+	MSG(MISSION_REQUEST_LIST, mission_request_list) \
+	MSG(MISSION_REQUEST_PARTIAL_LIST, mission_request_partial_list) \
+	MSG(MISSION_SET_CURRENT, mission_set_current) \
+	MSG(MISSION_WRITE_PARTIAL_LIST, mission_write_partial_list) \
+	MSG(NAMED_VALUE_FLOAT, named_value_float) \
+	MSG(NAMED_VALUE_INT, named_value_int) \
+	MSG(NAV_CONTROLLER_OUTPUT, nav_controller_output) \
+	MSG(OPTICAL_FLOW, optical_flow) \
+	MSG(OPTICAL_FLOW_RAD, optical_flow_rad) \
+	MSG(PARAM_MAP_RC, param_map_rc) \
+	MSG(PARAM_REQUEST_LIST, param_request_list) \
+	MSG(PARAM_REQUEST_READ, param_request_read) \
+	MSG(PARAM_SET, param_set) \
+	MSG(PARAM_VALUE, param_value) \
+	MSG(PING, ping) \
+	MSG(POSITION_TARGET_GLOBAL_INT, position_target_global_int) \
+	MSG(POSITION_TARGET_LOCAL_NED, position_target_local_ned) \
+	MSG(POWER_STATUS, power_status) \
+	MSG(RADIO_STATUS, radio_status) \
+	MSG(RAW_IMU, raw_imu) \
+	MSG(RAW_PRESSURE, raw_pressure) \
+	MSG(RC_CHANNELS, rc_channels) \
+	MSG(RC_CHANNELS_OVERRIDE, rc_channels_override) \
+	MSG(RC_CHANNELS_RAW, rc_channels_raw) \
+	MSG(RC_CHANNELS_SCALED, rc_channels_scaled) \
+	MSG(REQUEST_DATA_STREAM, request_data_stream) \
+	MSG(RESOURCE_REQUEST, resource_request) \
+	MSG(SAFETY_ALLOWED_AREA, safety_allowed_area) \
+	MSG(SAFETY_SET_ALLOWED_AREA, safety_set_allowed_area) \
+	MSG(SCALED_IMU, scaled_imu) \
+	MSG(SCALED_IMU2, scaled_imu2) \
+	MSG(SCALED_IMU3, scaled_imu3) \
+	MSG(SCALED_PRESSURE, scaled_pressure) \
+	MSG(SCALED_PRESSURE2, scaled_pressure2) \
+	MSG(SCALED_PRESSURE3, scaled_pressure3) \
+	MSG(SERIAL_CONTROL, serial_control) \
+	MSG(SERVO_OUTPUT_RAW, servo_output_raw) \
+	MSG(SET_ACTUATOR_CONTROL_TARGET, set_actuator_control_target) \
+	MSG(SET_ATTITUDE_TARGET, set_attitude_target) \
+	MSG(SET_GPS_GLOBAL_ORIGIN, set_gps_global_origin) \
+	MSG(SET_HOME_POSITION, set_home_position) \
+	MSG(SET_MODE, set_mode) \
+	MSG(SET_POSITION_TARGET_GLOBAL_INT, set_position_target_global_int) \
+	MSG(SET_POSITION_TARGET_LOCAL_NED, set_position_target_local_ned) \
+	MSG(SIM_STATE, sim_state) \
+	MSG(STATUSTEXT, statustext) \
+	MSG(SYS_STATUS, sys_status) \
+	MSG(SYSTEM_TIME, system_time) \
+	MSG(TERRAIN_CHECK, terrain_check) \
+	MSG(TERRAIN_DATA, terrain_data) \
+	MSG(TERRAIN_REPORT, terrain_report) \
+	MSG(TERRAIN_REQUEST, terrain_request) \
+	MSG(TIMESYNC, timesync) \
+	MSG(V2_EXTENSION, v2_extension) \
+	MSG(VFR_HUD, vfr_hud) \
+	MSG(VIBRATION, vibration) \
+	MSG(VICON_POSITION_ESTIMATE, vicon_position_estimate) \
+	MSG(VISION_POSITION_ESTIMATE, vision_position_estimate) \
+	MSG(VISION_SPEED_ESTIMATE, vision_speed_estimate)
+
+#define MSG(NAME, name) \
+	static void old_##name(const void *payload) { \
+		mavlink_msg_##name##_encode(1, 200, &mav_msg, (const mavlink_##name##_t*)payload); \
+		dispatch(&mav_msg); \
+	} \
+	static void new_##name(const void *payload) { \
+		DISPATCH(NAME, *(const mavlink_##name##_t*)payload); \
+	}
+MAVLINK_COMMON_MESSAGES
+#undef MSG
+
+typedef void (*t_send)(const void *payload);
+
+struct _S_BENCH_MSG {
+	const char *name;
+	uint8_t msgid;
+	uint8_t len;
+	t_send old_fn;
+	t_send new_fn;
+};
+typedef struct _S_BENCH_MSG S_BENCH_MSG;
+
+#define MSG(NAME, name) {#name, MAVLINK_MSG_ID_##NAME, MAVLINK_MSG_ID_##NAME##_LEN, old_##name, new_##name},
+static const S_BENCH_MSG msgs[] = {
+	MAVLINK_COMMON_MESSAGES
+};
+#undef MSG
+
+#define MSG_COUNT (sizeof(msgs)/sizeof(msgs[0]))
+
+static double now_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1e9+t.tv_nsec;
+}
+
+//one frame through fn, returns its bytes in out
+static uint16_t frame_of(t_send fn, const void *payload, uint8_t *out) {
+	fn(payload);
+	udp_flush();
+	memcpy(out,sent,sent_len);
+	return sent_len;
+}
+
+//ns per frame, the best of ROUNDS runs so a preempted run does not count
+#define ROUNDS 3
+static double time_of(t_send fn, const void *payload, uint32_t frames) {
+	double t, best = 0;
+	uint32_t r, j;
+
+	for (r=0;r<ROUNDS;r++) {
+		//the queue is not flushed while timing, a full queue drops its oldest frame the same way for both paths
+		t = now_ns();
+		for (j=0;j<frames;j++) fn(payload);
+		t = (now_ns()-t)/frames;
+		udp_flush();
+		if (!r || t<best) best = t;
+	}
+	return best;
+}
+
+int main(int argc, char **argv) {
+	static uint8_t payload[MAVLINK_MAX_PAYLOAD_LEN];
+	uint8_t a[MAVLINK_MAX_PACKET_LEN], b[MAVLINK_MAX_PACKET_LEN];
+	uint32_t frames = 100000, i;
+	uint16_t la, lb;
+	uint8_t verbose = 0, failed = 0;
+	double old_ns, new_ns, old_sum = 0, new_sum = 0, ratio_min = 1e9, ratio_max = 0;
+
+	for (i=1;i<argc;i++) {
+		if (!strcmp(argv[i],"-v")) verbose = 1;
+		else frames = atoi(argv[i]);
+	}
+	if (!frames) frames = 1;
+
+	for (i=0;i<sizeof(payload);i++) payload[i] = i*37+11;
+
+	udp_init("127.0.0.1",9,0);
+
+	for (i=0;i<MSG_COUNT;i++) {
+		/*
+			the sequence counter lives in mavlink_get_channel_status, one per translation unit:
+			the old path counts in this file, dispatch_end in udp.c, so the old one is given the number the new one used
+		*/
+		lb = frame_of(msgs[i].new_fn,payload,b);
+		mavlink_get_channel_status(MAVLINK_COMM_0)->current_tx_seq = b[2];
+		la = frame_of(msgs[i].old_fn,payload,a);
+		if (msgs[i].msgid!=MAVLINK_MSG_ID_HEARTBEAT && (la!=lb || memcmp(a,b,la))) {
+			printf("%s: frames differ\n",msgs[i].name);
+			failed = 1;
+		}
+
+		old_ns = time_of(msgs[i].old_fn,payload,frames);
+		new_ns = time_of(msgs[i].new_fn,payload,frames);
+		old_sum += old_ns;
+		new_sum += new_ns;
+		if (new_ns/old_ns<ratio_min) ratio_min = new_ns/old_ns;
+		if (new_ns/old_ns>ratio_max) ratio_max = new_ns/old_ns;
+
+		if (verbose) printf("%-32s %3u B  old %7.1f ns  new %7.1f ns\n",msgs[i].name,msgs[i].len,old_ns,new_ns);
+	}
+
+	printf("%u messages, %u frames each (best of %u)%s\n",(unsigned)MSG_COUNT,frames,ROUNDS,failed?", OUTPUT DIFFERS":", output identical");
+	printf("per frame, mean over messages: old %.1f ns, new %.1f ns (%.0f%%)\n",old_sum/MSG_COUNT,new_sum/MSG_COUNT,100.*(new_sum-old_sum)/old_sum);
+	printf("new/old per message: %.2f .. %.2f\n",ratio_min,ratio_max);
+
+	return failed;
+}
@@ -0,0 +1,358 @@
+/*
+	bench_param_list: time until a GCS holds the whole param list, over a lossy radio link
+	params.c, mw.c, gamepad.c, rx.c, sched.c and event.c are the real ones and run in real time; simulated are:
+	- the radio: LINK_RATE bytes/s, LINK_BUFFER bytes of buffer (a frame that does not fit is lost),
+	  LINK_LATENCY_MS one way, every frame in both directions lost with the given probability
+	- the GCS: PARAM_REQUEST_LIST, then after GCS_RETRY_MS without a param every missing index is re-requested
+	  with PARAM_REQUEST_READ, as QGroundControl does
+	- mw-service: the shm calls of libmw_core, every request is answered after SERVICE_MS, one at a time
+	the board values are all zero, only the timing is of interest
+	use it to tune PARAM_LIST_RATE and PARAM_LOSSY (params.c)
+
+	usage: bench_param_list [-r runs] [-p params/s] [-v] [loss % ...]
+	without a loss 0 5 10 15 20 % are run; the same seeds are used for every loss
+	the results go to stderr, params.c prints every param it sends: bench_param_list >/dev/null
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../event.h"
+#include "../sched.h"
+#include "../rx.h"
+#include "../mw.h"
+#include "../params.h"
+#include "../global.h"
+
+#define LINK_RATE 5760 //bytes/s, 57600 baud
+#define LINK_BUFFER 2048 //bytes
+#define LINK_LATENCY_MS 20
+#define LINK_QUEUE 1024 //frames in flight
+
+#define GCS_RETRY_MS 500
+#define GCS_TIMEOUT_MS 60000 //a run that takes longer is given up
+
+#define SERVICE_MS 8 //per MSP response on the serial line to the board
+
+#define BENCH_PERIOD_MS 2
+#define RUNS 6
+#define MAX_LOSS 16
+
+//what main.c provides
+uint8_t debug = 0;
+uint64_t start_time = 0;
+uint16_t heartbeat = 0;
+
+static uint8_t stop = 0;
+static uint8_t verbose = 0;
+
+/*
+	radio link
+*/
+struct _S_LINK_FRAME {
+	uint64_t at; //us, arrives
+	uint8_t component;
+	uint16_t index;
+	uint16_t count;
+};
+typedef struct _S_LINK_FRAME S_LINK_FRAME;
+
+static S_LINK_FRAME down[LINK_QUEUE]; //vehicle -> GCS, PARAM_VALUE
+static S_LINK_FRAME up[LINK_QUEUE]; //GCS -> vehicle, PARAM_REQUEST_READ
+static uint16_t down_head, down_count, up_head, up_count;
+static uint64_t link_free; //us, the radio has sent everything queued before this
+static double link_loss;
+static uint32_t link_sent, link_lost, link_overflow;
+
+static void link_reset() {
+	down_head = down_count = up_head = up_count = 0;
+	link_free = 0;
+	link_sent = link_lost = link_overflow = 0;
+}
+
+static void link_push(S_LINK_FRAME *q, uint16_t head, uint16_t *count, S_LINK_FRAME *f) {
+	if (*count==LINK_QUEUE) return;
+	q[(head+*count)%LINK_QUEUE] = *f;
+	(*count)++;
+}
+
+//everything the vehicle sends goes through here
+void dispatch(mavlink_message_t *msg) {
+	uint64_t now = event_now_us();
+	uint32_t len = MAVLINK_NUM_NON_PAYLOAD_BYTES+msg->len;
+	mavlink_param_value_t v;
+	S_LINK_FRAME f;
+
+	if (msg->msgid!=MAVLINK_MSG_ID_PARAM_VALUE) return;
+	link_sent++;
+
+	if (link_free<now) link_free = now;
+	if ((link_free-now)*LINK_RATE/1000000+len>LINK_BUFFER) { //radio buffer full
+		link_overflow++;
+		return;
+	}
+	link_free += (uint64_t)len*1000000/LINK_RATE;
+
+	if (drand48()<link_loss) {
+		link_lost++;
+		return;
+	}
+
+	mavlink_msg_param_value_decode(msg,&v);
+	f.at = link_free+LINK_LATENCY_MS*1000;
+	f.component = msg->compid;
+	f.index = v.param_index;
+	f.count = v.param_count;
+	link_push(down,down_head,&down_count,&f);
+}
+
+void dispatch_payload(uint8_t sysid, uint8_t compid, uint8_t msgid, const void *payload, uint8_t len, uint8_t crc_extra) {
+}
+
+uint64_t udp_get_rx_stamp() {
+	return event_now_us();
+}
+
+char *get_gc_ip() {
+	return "127.0.0.1";
+}
+
+/*
+	mw-service
+*/
+static uint64_t service_ready[256]; //us, when the response to msgid is there, 0 - none pending
+static uint64_t service_free; //us
+
+uint8_t shm_client_init() {
+	memset(service_ready,0,sizeof(service_ready));
+	service_free = 0;
+	return 0;
+}
+
+void shm_client_end() {
+}
+
+void shm_put_outgoing(struct S_MSG *m) {
+	uint64_t now = event_now_us();
+
+	if (m->message_id>=200) return; //MSP_SET_xxx, no response
+	if (service_free<now) service_free = now;
+	service_free += SERVICE_MS*1000;
+	service_ready[m->message_id] = service_free;
+}
+
+uint8_t shm_get_incoming(struct S_MSG *m, uint8_t id) {
+	return 1;
+}
+
+uint8_t shm_scan_incoming_f(struct S_MSG *m, uint8_t *filter, uint8_t n) {
+	uint8_t i, id;
+
+	for (i=0;i<n;i++) {
+		id = filter[i];
+		if (!service_ready[id] || event_now_us()<service_ready[id]) continue;
+		service_ready[id] = 0;
+		memset(m,0,sizeof(struct S_MSG));
+		m->message_id = id;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+	GCS
+*/
+static uint8_t got[PARAM_COMPONENT_COUNT][256];
+static int16_t got_count[PARAM_COMPONENT_COUNT]; //param_count, -1 - nothing received yet
+static uint64_t gcs_start, gcs_last; //us
+static uint32_t gcs_rounds, gcs_requests;
+
+static void gcs_reset() {
+	memset(got,0,sizeof(got));
+	memset(got_count,-1,sizeof(got_count));
+	gcs_start = gcs_last = event_now_us();
+	gcs_rounds = gcs_requests = 0;
+}
+
+static uint8_t gcs_complete() {
+	uint8_t c;
+	uint16_t i;
+
+	for (c=0;c<PARAM_COMPONENT_COUNT;c++) {
+		if (got_count[c]<0) return 0;
+		for (i=0;i<got_count[c];i++)
+			if (!got[c][i]) return 0;
+	}
+	return 1;
+}
+
+static void gcs_request(uint8_t component, uint16_t index) {
+	S_LINK_FRAME f;
+
+	gcs_requests++;
+	if (drand48()<link_loss) return;
+
+	f.at = event_now_us()+LINK_LATENCY_MS*1000;
+	f.component = component;
+	f.index = index;
+	link_push(up,up_head,&up_count,&f);
+}
+
+//delivers what has arrived on either side; returns 1 once the GCS holds every param
+static uint8_t gcs_poll() {
+	uint64_t now = event_now_us();
+	mavlink_message_t msg;
+	S_LINK_FRAME *f;
+	uint8_t c;
+	uint16_t i;
+
+	while (down_count && down[down_head].at<=now) {
+		f = &down[down_head];
+		c = f->component-PARAM_COMPONENT_FIRST;
+		if (c<PARAM_COMPONENT_COUNT && f->index<256) { //not the hash check, which has index UINT16_MAX
+			got_count[c] = f->count;
+			got[c][f->index] = 1;
+			gcs_last = now;
+		}
+		down_head = (down_head+1)%LINK_QUEUE;
+		down_count--;
+	}
+
+	while (up_count && up[up_head].at<=now) {
+		f = &up[up_head];
+		mavlink_msg_param_request_read_pack(255,0,&msg,1,f->component,"",f->index);
+		rx_dispatch(&msg);
+		up_head = (up_head+1)%LINK_QUEUE;
+		up_count--;
+	}
+
+	if (gcs_complete()) return 1;
+
+	if (now-gcs_last>GCS_RETRY_MS*1000) {
+		gcs_rounds++;
+		gcs_last = now;
+		for (c=0;c<PARAM_COMPONENT_COUNT;c++)
+			for (i=0;i<(got_count[c]<0?1:got_count[c]);i++)
+				if (!got[c][i]) gcs_request(PARAM_COMPONENT_FIRST+c,i);
+	}
+
+	return 0;
+}
+
+/*
+	runs
+*/
+struct _S_RUN_SUM {
+	uint32_t runs;
+	uint32_t failed;
+	uint64_t ms;
+	uint32_t ms_max;
+	uint32_t rounds;
+	uint32_t requests;
+	uint32_t sent;
+	uint32_t lost;
+};
+typedef struct _S_RUN_SUM S_RUN_SUM;
+
+static double loss[MAX_LOSS];
+static uint8_t loss_count = 0;
+static uint8_t loss_cur = 0;
+static uint8_t runs = RUNS;
+static uint8_t run = 0;
+static uint8_t running = 0;
+static S_RUN_SUM sum;
+
+static void run_start() {
+	mavlink_message_t msg;
+
+	link_loss = loss[loss_cur];
+	srand48(run+1);
+	link_reset();
+	gcs_reset();
+	running = 1;
+
+	mavlink_msg_param_request_list_pack(255,0,&msg,1,0);
+	rx_dispatch(&msg);
+}
+
+static void run_end(uint8_t ok) {
+	uint32_t ms = (event_now_us()-gcs_start)/1000;
+
+	if (verbose) fprintf(stderr,"loss %2.0f%% run %u: %s %u ms, %u retry rounds, %u re-requests, %u sent, %u lost, %u overflow\n",
+		loss[loss_cur]*100,run,ok?"":"GAVE UP after",ms,gcs_rounds,gcs_requests,link_sent,link_lost,link_overflow);
+
+	sum.runs++;
+	if (!ok) sum.failed++;
+	sum.ms += ms;
+	if (ms>sum.ms_max) sum.ms_max = ms;
+	sum.rounds += gcs_rounds;
+	sum.requests += gcs_requests;
+	sum.sent += link_sent;
+	sum.lost += link_lost+link_overflow;
+	running = 0;
+
+	if (++run<runs) return;
+
+	fprintf(stderr,"loss %2.0f%%: %6.0f ms mean, %5u ms max, %.1f retry rounds, %.1f re-requests, %.1f sent, %.1f lost%s\n",
+		loss[loss_cur]*100,(double)sum.ms/sum.runs,sum.ms_max,(double)sum.rounds/sum.runs,(double)sum.requests/sum.runs,
+		(double)sum.sent/sum.runs,(double)sum.lost/sum.runs,sum.failed?" (runs given up)":"");
+	memset(&sum,0,sizeof(sum));
+	run = 0;
+	if (++loss_cur==loss_count) stop = 1;
+}
+
+static void bench_task() {
+	if (!mw_ready()) return; //the handshake with the simulated board comes first
+
+	if (!running) {
+		run_start();
+		return;
+	}
+
+	if (gcs_poll()) run_end(1);
+	else if (event_now_us()-gcs_start>(uint64_t)GCS_TIMEOUT_MS*1000) run_end(0);
+}
+
+int main(int argc, char **argv) {
+	int c;
+
+	while ((c = getopt(argc, argv, "r:p:v")) != -1) {
+		switch (c) {
+			case 'r': runs = atoi(optarg); break;
+			case 'p': params_set_list_rate(atoi(optarg)); break;
+			case 'v': verbose = 1; break;
+			default:
+				printf("usage: %s [-r runs] [-p params/s] [-v] [loss %% ...]\n",argv[0]);
+				return 1;
+		}
+	}
+	if (!runs) runs = 1;
+
+	for (;optind<argc && loss_count<MAX_LOSS;optind++) loss[loss_count++] = atof(argv[optind])/100;
+	if (!loss_count)
+		for (;loss_count<5;loss_count++) loss[loss_count] = loss_count*0.05;
+
+	//a cold start every time, the files are the benchmark's own (see Makefile.am)
+	unlink(PARAM_STORE_FILE);
+	unlink(MW_CACHE_FILE);
+
+	start_time = event_now_us();
+	sched_init();
+	if (event_init()) return 1;
+	rx_init();
+	if (mw_init()) return 1;
+	params_init();
+
+	fprintf(stderr,"radio %u B/s, %u B buffer, %u ms latency; GCS retries after %u ms; %u runs per loss\n",
+		LINK_RATE,LINK_BUFFER,LINK_LATENCY_MS,GCS_RETRY_MS,runs);
+
+	sched_add(bench_task,BENCH_PERIOD_MS,0);
+	event_loop(&stop);
+
+	params_end();
+	mw_end();
+	unlink(PARAM_STORE_FILE);
+	unlink(MW_CACHE_FILE);
+
+	return 0;
+}
@@ -0,0 +1,179 @@
+/*
+	bench_params: saving and loading the params, the param store against the libconfig file of older versions
+	store: params_store_save writes the slots of the changed params and msyncs, params_store_load maps the file and
+	matches the records (params.c as it is)
+	libconfig: cfg_save/cfg_load below are params_cfg_save/params_cfg_load as they were before the store, the whole
+	file is parsed and the "params" array rebuilt and written on every save; that file was never synced, the
+	synced variant adds the fsync the store does, for a fair comparison
+	every save changes one param, as a PARAM_SET does
+
+	usage: bench_params [operations] >/dev/null
+	the results go to stderr, params.c prints a line for every load
+*/
+#include "../params.c" //the param table and the store functions are static
+#include <time.h>
+
+#define OPS 200
+#define BENCH_CFG_FILE "/tmp/bench_params.cfg"
+
+//what main.c provides
+uint64_t start_time = 0;
+uint16_t heartbeat = 0;
+
+//nothing is received, rx.c is left out (its debug would clash with the one of params.c)
+uint8_t rx_register(uint8_t msgid, t_rx_cb cb) {
+	return 0;
+}
+
+uint8_t rx_register_batch_end(t_rx_batch_cb cb) {
+	return 0;
+}
+
+#ifdef CFG_ENABLED
+static void cfg_save(uint8_t sync) {
+	uint8_t i;
+	int fd;
+
+	config_init(&cfg);
+	config_read_file(&cfg, BENCH_CFG_FILE);
+	config_setting_t *root = config_root_setting(&cfg);
+	config_setting_t *ptr;
+
+	config_setting_t *setting = config_lookup(&cfg,"params");
+
+	config_setting_remove(root,"params");
+
+	setting = config_setting_add(root, "params", CONFIG_TYPE_ARRAY);
+	for (i=0;i<params_count();i++)
+		if (param[i].can_save) {
+			ptr=config_setting_add(setting,NULL,CONFIG_TYPE_FLOAT);
+			mavlink_param_union_t *v = _get_value(param[i].component,param[i].id);
+			config_setting_set_float(ptr,v->param_float);
+		}
+
+	if (!config_write_file(&cfg,BENCH_CFG_FILE))
+		printf("Error while writing config file. Settings won't be stored.\n");
+
+	config_destroy(&cfg);
+
+	if (!sync) return;
+	fd = open(BENCH_CFG_FILE,O_RDONLY);
+	if (fd<0 || fsync(fd)) perror(BENCH_CFG_FILE);
+	if (fd>=0) close(fd);
+}
+
+static void cfg_load() {
+	uint8_t i,j;
+	uint8_t count = 0;
+
+	config_init(&cfg);
+	if (!config_read_file(&cfg, BENCH_CFG_FILE)) {
+		fprintf(stderr, "%s:%d - %s\n", config_error_file(&cfg),
+			config_error_line(&cfg), config_error_text(&cfg));
+		config_destroy(&cfg);
+		return;
+	}
+
+	config_setting_t *setting = config_lookup(&cfg,"params");
+
+	for (i=0;i<params_count();i++)
+		if (param[i].can_save) count++;
+
+	if (setting && config_setting_length(setting)==count) {
+		j=0;
+		for (i=0;i<params_count();i++)
+			if (param[i].can_save) {
+				mavlink_param_union_t v;
+				v.param_float = config_setting_get_float_elem(setting,j++);
+				_set_value(param[i].component,param[i].id, &v );
+			}
+	}
+
+	config_destroy(&cfg);
+}
+#endif
+
+static double now_us() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1e6+t.tv_nsec/1e3;
+}
+
+//a new value for one param, as a PARAM_SET would set it
+static void change(struct s_param *p, uint32_t n) {
+	mavlink_param_union_t v;
+
+	memset(&v,0,sizeof(v));
+	v.param_uint8 = n%50;
+	_set_value(p->component,p->id,&v);
+}
+
+static double time_save(void (*save)(uint8_t sync), uint8_t sync, struct s_param *p, uint32_t ops) {
+	double t = now_us();
+	uint32_t i;
+
+	for (i=0;i<ops;i++) {
+		change(p,i);
+		save(sync);
+	}
+	return (now_us()-t)/ops;
+}
+
+static double time_load(void (*load)(), uint32_t ops) {
+	double t = now_us();
+	uint32_t i;
+
+	for (i=0;i<ops;i++) load();
+	return (now_us()-t)/ops;
+}
+
+static void store_save(uint8_t sync) {
+	params_store_save(); //always synced
+}
+
+static void store_load() {
+	params_store_load();
+}
+
+int main(int argc, char **argv) {
+	uint32_t ops = OPS;
+	struct s_param *p;
+	struct stat st;
+	uint8_t i, count = 0;
+
+	if (argc>1) ops = atoi(argv[1]);
+	if (!ops) ops = 1;
+
+	unlink(PARAM_STORE_FILE); //the store is the benchmark's own (see Makefile.am)
+	unlink(BENCH_CFG_FILE);
+
+	params_init(); //writes a new store
+	if (!param) return 1;
+	p = _get_param_by_name(202,"THRESHOLD_YAW");
+	if (!p) return 1;
+	for (i=0;i<params_count();i++)
+		if (param[i].can_save) count++;
+
+	stat(PARAM_STORE_FILE,&st);
+	fprintf(stderr,"%u params can be saved, store %lu bytes; %u operations each\n",count,(unsigned long)st.st_size,ops);
+	fprintf(stderr,"save, one param changed:\n");
+	fprintf(stderr,"  store                   %9.1f us\n",time_save(store_save,1,p,ops));
+#ifdef CFG_ENABLED
+	fprintf(stderr,"  libconfig               %9.1f us\n",time_save(cfg_save,0,p,ops));
+	fprintf(stderr,"  libconfig + fsync       %9.1f us\n",time_save(cfg_save,1,p,ops));
+#endif
+	fprintf(stderr,"load:\n");
+	fprintf(stderr,"  store                   %9.1f us\n",time_load(store_load,ops));
+#ifdef CFG_ENABLED
+	stat(BENCH_CFG_FILE,&st);
+	fprintf(stderr,"  libconfig (%5lu bytes) %9.1f us\n",(unsigned long)st.st_size,time_load(cfg_load,ops));
+#else
+	fprintf(stderr,"built without libconfig (--disable-config), nothing to compare with\n");
+#endif
+
+	params_end();
+	unlink(PARAM_STORE_FILE);
+	unlink(BENCH_CFG_FILE);
+
+	return 0;
+}
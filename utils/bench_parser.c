@@ -0,0 +1,292 @@
+/*
+	bench_parser: receive path, mavlink_parse_buffer against a mavlink_parse_char loop
+	both get the same byte stream in the same chunks (random sizes of 1..MAX_CHUNK bytes, like reads from a socket or a uart)
+	streams: every tlog given on the command line and a synthetic telemetry stream, each one clean and with noise
+	noise: at the given rate a byte is replaced, dropped or a random byte is inserted, as on a bad serial link
+	reported: MB/s of each parser, frames delivered, parse_error and buffer_overrun counts
+	parse_buffer counts every STX it rejects, also the ones inside a rejected frame, so its parse_error is the higher one
+
+	usage: bench_parser [-v] [file.tlog ...]
+	a tlog is read as QGroundControl writes it (8 byte timestamp before every frame), anything else as raw bytes
+	exits with 1 if the parsers do not deliver the same frames from a clean synthetic stream
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mavlink/common/mavlink.h"
+
+#define CHAN_CHAR MAVLINK_COMM_0
+#define CHAN_BUFFER MAVLINK_COMM_1
+
+#define MAX_CHUNK 512
+#define SYNTH_LEN (4*1024*1024) //bytes of synthetic telemetry
+#define MIN_BYTES (32*1024*1024) //every stream is parsed repeatedly until this many bytes went through each parser
+
+static const double noise_rate[] = {0, 0.0001, 0.001, 0.01, 0.05};
+#define NOISE_COUNT (sizeof(noise_rate)/sizeof(noise_rate[0]))
+
+//what a telemetry stream of this service is made of
+static const uint8_t synth_msgid[] = {
+	MAVLINK_MSG_ID_HEARTBEAT, MAVLINK_MSG_ID_SYS_STATUS, MAVLINK_MSG_ID_ATTITUDE, MAVLINK_MSG_ID_ATTITUDE,
+	MAVLINK_MSG_ID_ATTITUDE, MAVLINK_MSG_ID_GLOBAL_POSITION_INT, MAVLINK_MSG_ID_GPS_RAW_INT, MAVLINK_MSG_ID_RC_CHANNELS_RAW,
+	MAVLINK_MSG_ID_VFR_HUD, MAVLINK_MSG_ID_ALTITUDE, MAVLINK_MSG_ID_PARAM_VALUE, MAVLINK_MSG_ID_STATUSTEXT
+};
+
+struct _S_STREAM {
+	uint8_t *data;
+	uint32_t len;
+	uint16_t *chunk; //sizes the stream is fed in
+	uint32_t chunk_count;
+};
+typedef struct _S_STREAM S_STREAM;
+
+struct _S_RESULT {
+	double mbps;
+	uint32_t frames;
+	uint32_t parse_error;
+	uint32_t overrun;
+	uint32_t sum; //over msgid and seq of the delivered frames, tells if the same frames came out
+};
+typedef struct _S_RESULT S_RESULT;
+
+static uint32_t cb_frames, cb_sum;
+
+static void cb(mavlink_message_t *msg) {
+	cb_frames++;
+	cb_sum = cb_sum*31 + (msg->msgid<<8) + msg->seq;
+}
+
+static double now_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1e9+t.tv_nsec;
+}
+
+static void stream_chunks(S_STREAM *s) {
+	uint32_t pos;
+
+	s->chunk = malloc((s->len+1)*sizeof(uint16_t));
+	s->chunk_count = 0;
+	for (pos=0;pos<s->len;pos+=s->chunk[s->chunk_count++]) {
+		s->chunk[s->chunk_count] = 1+rand()%MAX_CHUNK;
+		if (s->chunk[s->chunk_count]>s->len-pos) s->chunk[s->chunk_count] = s->len-pos;
+	}
+}
+
+static void stream_free(S_STREAM *s) {
+	free(s->data);
+	free(s->chunk);
+}
+
+static void synth_stream(S_STREAM *s) {
+	static const uint8_t lengths[256] = MAVLINK_MESSAGE_LENGTHS;
+	static const uint8_t crcs[256] = MAVLINK_MESSAGE_CRCS;
+	mavlink_message_t msg;
+	uint8_t *payload = (uint8_t *)_MAV_PAYLOAD_NON_CONST(&msg);
+	uint8_t msgid, i;
+
+	s->data = malloc(SYNTH_LEN);
+	s->len = 0;
+	while (s->len+MAVLINK_MAX_PACKET_LEN<=SYNTH_LEN) {
+		msgid = synth_msgid[rand()%sizeof(synth_msgid)];
+		msg.msgid = msgid;
+		for (i=0;i<lengths[msgid];i++) payload[i] = rand(); //random payloads put STX bytes inside frames
+		mavlink_finalize_message(&msg, 1, 200, lengths[msgid], crcs[msgid]);
+		s->len += mavlink_msg_to_send_buffer(s->data+s->len, &msg);
+	}
+}
+
+//a tlog is 8 byte timestamp + frame per record; anything that does not fit this is taken as raw bytes
+static uint8_t load_stream(S_STREAM *s, const char *name) {
+	FILE *f;
+	long size;
+	uint8_t *raw;
+	uint32_t pos, flen;
+
+	f = fopen(name,"rb");
+	if (!f) {
+		perror(name);
+		return 1;
+	}
+	fseek(f,0,SEEK_END);
+	size = ftell(f);
+	fseek(f,0,SEEK_SET);
+	raw = malloc(size?size:1);
+	if (fread(raw,1,size,f)!=(size_t)size) {
+		perror(name);
+		fclose(f);
+		free(raw);
+		return 1;
+	}
+	fclose(f);
+
+	s->data = malloc(size?size:1);
+	s->len = 0;
+	for (pos=0;pos+8+2<=size;pos+=8+flen) {
+		if (raw[pos+8]!=MAVLINK_STX) break;
+		flen = MAVLINK_NUM_NON_PAYLOAD_BYTES+raw[pos+9];
+		if (pos+8+flen>size) break;
+		memcpy(s->data+s->len,raw+pos+8,flen);
+		s->len += flen;
+	}
+
+	if (pos!=size) { //not a tlog
+		memcpy(s->data,raw,size);
+		s->len = size;
+		printf("%s: %u bytes, raw\n",name,s->len);
+	} else printf("%s: %u bytes of frames, tlog\n",name,s->len);
+
+	free(raw);
+	return 0;
+}
+
+static void noise_stream(S_STREAM *dst, const S_STREAM *src, double rate) {
+	uint32_t i;
+	uint32_t threshold = rate*RAND_MAX;
+
+	dst->data = malloc(src->len*2+1);
+	dst->len = 0;
+	for (i=0;i<src->len;i++) {
+		if ((uint32_t)rand()>=threshold) {
+			dst->data[dst->len++] = src->data[i];
+			continue;
+		}
+		switch (rand()%3) {
+			case 0: dst->data[dst->len++] = rand(); break; //replaced
+			case 1: break; //dropped
+			case 2: dst->data[dst->len++] = rand(); dst->data[dst->len++] = src->data[i]; break; //inserted
+		}
+	}
+}
+
+/*
+	feeds the stream once; with r the frames and the channel status counters are collected
+	the counters are 8 bit, so they are cleared before every chunk and summed after it
+	mavlink_parse_char hands parse_error over in packet_rx_drop_count of its status copy and clears it on every byte
+*/
+static void run_char(const S_STREAM *s, S_RESULT *r) {
+	mavlink_status_t *st = mavlink_get_channel_status(CHAN_CHAR);
+	mavlink_message_t msg;
+	mavlink_status_t tmp;
+	const uint8_t *p = s->data;
+	uint32_t c, j;
+
+	for (c=0;c<s->chunk_count;c++) {
+		if (!r) {
+			for (j=0;j<s->chunk[c];j++)
+				if (mavlink_parse_char(CHAN_CHAR, p[j], &msg, &tmp)) cb(&msg);
+			p += s->chunk[c];
+			continue;
+		}
+
+		st->buffer_overrun = 0;
+		for (j=0;j<s->chunk[c];j++) {
+			if (mavlink_parse_char(CHAN_CHAR, p[j], &msg, &tmp)) cb(&msg);
+			r->parse_error += tmp.packet_rx_drop_count;
+		}
+		p += s->chunk[c];
+		r->overrun += st->buffer_overrun;
+	}
+	if (r) r->parse_error += st->parse_error; //a bad CRC on the last byte
+}
+
+static void run_buffer(const S_STREAM *s, S_RESULT *r) {
+	mavlink_status_t *st = mavlink_get_channel_status(CHAN_BUFFER);
+	const uint8_t *p = s->data;
+	uint32_t c;
+
+	for (c=0;c<s->chunk_count;c++) {
+		if (r) st->parse_error = st->buffer_overrun = 0;
+		mavlink_parse_buffer(CHAN_BUFFER, p, s->chunk[c], cb);
+		p += s->chunk[c];
+		if (r) {
+			r->parse_error += st->parse_error;
+			r->overrun += st->buffer_overrun;
+		}
+	}
+}
+
+//completes a frame cut at the end of a stream with zeros, so the next stream starts clean
+static void run_flush() {
+	static const uint8_t zeros[2*MAVLINK_MAX_PACKET_LEN];
+	mavlink_message_t msg;
+	mavlink_status_t tmp;
+	uint16_t i;
+
+	for (i=0;i<sizeof(zeros);i++) mavlink_parse_char(CHAN_CHAR, zeros[i], &msg, &tmp);
+	mavlink_parse_buffer(CHAN_BUFFER, zeros, sizeof(zeros), cb);
+}
+
+//one counted pass, then the stream is parsed again until MIN_BYTES went through for the speed
+static void measure(void (*run)(const S_STREAM *s, S_RESULT *r), const S_STREAM *s, S_RESULT *r) {
+	uint32_t rounds = MIN_BYTES/(s->len?s->len:1)+1, i;
+	double t;
+
+	memset(r,0,sizeof(S_RESULT));
+	cb_frames = cb_sum = 0;
+	run(s,r);
+	r->frames = cb_frames;
+	r->sum = cb_sum;
+	run_flush();
+
+	t = now_ns();
+	for (i=0;i<rounds;i++) run(s,NULL);
+	t = now_ns()-t;
+	r->mbps = (double)s->len*rounds/t*1e3;
+	run_flush();
+}
+
+//returns 1 if both parsers delivered the same frames
+static uint8_t bench(const char *name, const S_STREAM *src, uint8_t verbose) {
+	S_STREAM s;
+	S_RESULT c, b;
+	uint32_t n;
+	uint8_t same = 1;
+
+	for (n=0;n<NOISE_COUNT;n++) {
+		noise_stream(&s,src,noise_rate[n]);
+		stream_chunks(&s);
+
+		measure(run_char,&s,&c);
+		measure(run_buffer,&s,&b);
+		if (!n) same = c.frames==b.frames && c.sum==b.sum;
+
+		printf("%-10s noise %5.2f%%  parse_char %7.1f MB/s  parse_buffer %7.1f MB/s  x%.2f\n",
+			name,noise_rate[n]*100,c.mbps,b.mbps,b.mbps/c.mbps);
+		if (verbose || n) printf("%-10s %14s  frames %u/%u  parse_error %u/%u  overrun %u/%u (char/buffer)\n",
+			"","",c.frames,b.frames,c.parse_error,b.parse_error,c.overrun,b.overrun);
+
+		stream_free(&s);
+	}
+
+	return same;
+}
+
+int main(int argc, char **argv) {
+	S_STREAM s;
+	uint8_t verbose = 0, failed = 0;
+	int i;
+
+	srand(1);
+
+	for (i=1;i<argc;i++) {
+		if (!strcmp(argv[i],"-v")) {
+			verbose = 1;
+			continue;
+		}
+		if (load_stream(&s,argv[i])) return 1;
+		if (!bench(argv[i],&s,verbose)) printf("%s: the parsers disagree on the clean stream\n",argv[i]);
+		free(s.data);
+	}
+
+	synth_stream(&s);
+	printf("synthetic: %u bytes of frames\n",s.len);
+	if (!bench("synthetic",&s,verbose)) {
+		printf("synthetic: the parsers disagree on the clean stream\n");
+		failed = 1;
+	}
+	free(s.data);
+
+	return failed;
+}